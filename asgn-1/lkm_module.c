@@ -11,14 +11,46 @@
 #include <linux/uaccess.h>
 #include <linux/slab.h>
 #include <linux/mutex.h>
+#include <linux/jump_label.h>
+#include <linux/hashtable.h>
+#include <linux/rcupdate.h>
 
 #define DEVICE_NAME "partb_1_7"
 #define current get_current()
 #define INF 1000000000
 
+/* number of buckets in the process table is 2^HTABLE_BITS */
+#define HTABLE_BITS 10
+
 MODULE_AUTHOR("PRIT_BOB");
 MODULE_LICENSE("GPL");
 
+/* per-operation logging is patched out by a static key unless the debug parameter is set */
+static DEFINE_STATIC_KEY_FALSE(pq_debug_key);
+static bool debug;
+
+static int debug_param_set(const char *val, const struct kernel_param *kp){
+    int ret = param_set_bool(val, kp);
+
+    if(ret == 0){
+        if(debug)
+            static_branch_enable(&pq_debug_key);
+        else
+            static_branch_disable(&pq_debug_key);
+    }
+    return ret;
+}
+
+static const struct kernel_param_ops debug_param_ops = {
+    .set = debug_param_set,
+    .get = param_get_bool,
+};
+module_param_cb(debug, &debug_param_ops, &debug, 0644);
+MODULE_PARM_DESC(debug, "log every queue operation to the kernel ring buffer (default N)");
+
+#define pq_log(...) \
+    do { if(static_branch_unlikely(&pq_debug_key)) printk(__VA_ARGS__); } while(0)
+
 static DEFINE_SPINLOCK(pq_mutex);
 
 typedef struct _data {
@@ -42,10 +74,11 @@ typedef struct _priority_queue{
 typedef struct hashtable{
     int key;
     priority_queue *pq;
-    struct hashtable *next;
+    struct hlist_node node;
+    struct rcu_head rcu;
 } hashtable;
 
-struct hashtable *htable;
+static DEFINE_HASHTABLE(htable, HTABLE_BITS);
 
 /* Function Prototypes */
 /* Priority Queue Methods */
@@ -78,57 +111,68 @@ static struct proc_ops file_ops =
 	.proc_release = dev_release,
 };
 
+/* lookups walk a single bucket under rcu_read_lock() and never take pq_mutex;
+ * an entry is only removed by its own process on release, so it outlives the read section */
 static hashtable* get_hashtable_entry(int key){
-    hashtable *entry = htable->next;
-    while(entry != NULL){
+    hashtable *entry;
+
+    rcu_read_lock();
+    hash_for_each_possible_rcu(htable, entry, node, key){
         if(entry->key == key){
+            rcu_read_unlock();
             return entry;
         }
-        entry = entry->next;
     }
+    rcu_read_unlock();
     return NULL;
 }
 
+/* caller must hold pq_mutex */
 static void add_process_entry(hashtable* entry){
-    entry->next = htable->next;
-    htable->next = entry;
+    hash_add_rcu(htable, &entry->node, entry->key);
 }
 
 static void destroy_hashtable(void){
-    hashtable *entry, *temp;
-    entry = htable->next;
-    while(entry != NULL){
-        temp = entry;
-        printk(KERN_INFO DEVICE_NAME ": (free_hashtable_entry) [key = %d]", entry->key);
-        entry = entry->next;
-        kfree(temp);
+    hashtable *entry;
+    struct hlist_node *temp;
+    int bkt;
+
+    spin_lock(&pq_mutex);
+    hash_for_each_safe(htable, bkt, temp, entry, node){
+        pq_log(KERN_INFO DEVICE_NAME ": (free_hashtable_entry) [key = %d]", entry->key);
+        hash_del_rcu(&entry->node);
+        destroy_priority_queue(entry->pq);
+        kfree_rcu(entry, rcu);
     }
-    kfree(htable);
+    spin_unlock(&pq_mutex);
 }
 
+/* caller must hold pq_mutex, the entry is freed after an RCU grace period */
 static void remove_process_entry(int key){
-    hashtable *entry = htable->next;
-    hashtable *prev = htable;
-    while(entry != NULL){
+    hashtable *entry;
+
+    hash_for_each_possible(htable, entry, node, key){
         if(entry->key == key){
-            prev->next = entry->next;
+            hash_del_rcu(&entry->node);
             destroy_priority_queue(entry->pq);
-            entry->next = NULL;
-            printk(KERN_INFO DEVICE_NAME ": (remove_process_entry) [pid = %d], [key = %d]", current->pid, entry->key);
-            kfree(entry);
+            pq_log(KERN_INFO DEVICE_NAME ": (remove_process_entry) [pid = %d], [key = %d]", current->pid, entry->key);
+            kfree_rcu(entry, rcu);
             return;
         }
-        prev = entry;
-        entry = entry->next;
     }
 }
 
 static void print_all_processes(void){
-    hashtable *entry = htable->next;
+    hashtable *entry;
+    int bkt;
+
+    if(!static_branch_unlikely(&pq_debug_key)){
+        return;
+    }
+
     printk(KERN_INFO DEVICE_NAME ": (print_all_processes) Total %d processes", num_open_processes);
-    while(entry != NULL){
+    hash_for_each(htable, bkt, entry, node){
         printk(KERN_INFO DEVICE_NAME ": (print_all_processes) [pid = %d]", entry->key);
-		entry = entry->next;
     }
 }
 
@@ -160,7 +204,7 @@ static priority_queue* destroy_priority_queue(priority_queue* pq){
     if(pq == NULL){
         return pq;
     }
-    printk(KERN_INFO DEVICE_NAME ": [pid = %d], %ld bytes of priority_queue->arr Space freed.\n", current->pid, sizeof(pq->arr));
+    pq_log(KERN_INFO DEVICE_NAME ": [pid = %d], %ld bytes of priority_queue->arr Space freed.\n", current->pid, sizeof(pq->arr));
 	kfree_const(pq->arr);
 	kfree_const(pq);
     return NULL;
@@ -288,7 +332,7 @@ static ssize_t dev_write(struct file* file, const char* inbuffer, size_t inbuffe
 
     proc_entry = get_hashtable_entry(current->pid);
     if(proc_entry == NULL) {
-        printk(KERN_ALERT DEVICE_NAME ": <dev_write> [PID:%d] hashtable entry for current pid is non-existent", current->pid);
+        pq_log(KERN_ALERT DEVICE_NAME ": <dev_write> [PID:%d] hashtable entry for current pid is non-existent", current->pid);
         return -EACCES;
     }
 
@@ -297,7 +341,7 @@ static ssize_t dev_write(struct file* file, const char* inbuffer, size_t inbuffe
 
     if(pq_is_init) {
         if(inbuffer_size != 4) {
-            printk(KERN_ALERT DEVICE_NAME ": <dev_write> [PID:%d] %ld bytes received instead of expected 8 bytes[2*sizeof(int)].", current->pid, inbuffer_size);
+            pq_log(KERN_ALERT DEVICE_NAME ": <dev_write> [PID:%d] %ld bytes received instead of expected 8 bytes[2*sizeof(int)].", current->pid, inbuffer_size);
             return -EINVAL;
         }
 
@@ -306,9 +350,9 @@ static ssize_t dev_write(struct file* file, const char* inbuffer, size_t inbuffe
         memcpy(&num, arr, sizeof(num));
 
         if(proc_entry->pq->input_state == 1){
-            printk(KERN_INFO DEVICE_NAME ": <dev_write> [PID:%d] received value=%d for inserting into priority_queue.\n", current->pid, num);
+            pq_log(KERN_INFO DEVICE_NAME ": <dev_write> [PID:%d] received value=%d for inserting into priority_queue.\n", current->pid, num);
         }else{
-            printk(KERN_INFO DEVICE_NAME ": <dev_write> [PID:%d] received priority=%d for inserting into priority_queue.\n", current->pid, num);
+            pq_log(KERN_INFO DEVICE_NAME ": <dev_write> [PID:%d] received priority=%d for inserting into priority_queue.\n", current->pid, num);
         }
 
         ret = push_value(proc_entry->pq, num);
@@ -323,10 +367,10 @@ static ssize_t dev_write(struct file* file, const char* inbuffer, size_t inbuffe
     }
 
     pq_size = inbuffer[0];
-    printk(KERN_INFO DEVICE_NAME ": <dev_write> [PID:%d] priority_queue size recieved : %d.\n", current->pid, pq_size);
+    pq_log(KERN_INFO DEVICE_NAME ": <dev_write> [PID:%d] priority_queue size recieved : %d.\n", current->pid, pq_size);
 
     if(pq_size <= 0 || pq_size > 100) {
-        printk(KERN_ALERT DEVICE_NAME ": <dev_write> [PID:%d] priority_queue size must be integer in [0,100]. \n", current->pid);
+        pq_log(KERN_ALERT DEVICE_NAME ": <dev_write> [PID:%d] priority_queue size must be integer in [0,100]. \n", current->pid);
         return -EINVAL;
     }
 
@@ -349,32 +393,32 @@ static ssize_t dev_read(struct file* file, char* inbuffer, size_t inbuffer_size,
 
     proc_entry = get_hashtable_entry(current->pid);
     if(proc_entry == NULL) {
-        printk(KERN_ALERT DEVICE_NAME ": <dev_read> [PID:%d] hashtable entry for current pid is non-existent", current->pid);
+        pq_log(KERN_ALERT DEVICE_NAME ": <dev_read> [PID:%d] hashtable entry for current pid is non-existent", current->pid);
         return -EACCES;
     }
 
     pq_is_init = (proc_entry->pq) ? 1 : 0;
 
     if(!pq_is_init) {
-        printk(KERN_ALERT DEVICE_NAME ": <dev_read> [PID:%d] priority_queue not initialized.\n", current->pid);
+        pq_log(KERN_ALERT DEVICE_NAME ": <dev_read> [PID:%d] priority_queue not initialized.\n", current->pid);
         return -EACCES;
     }
 
     if(sizeof(pq_top_elem) != inbuffer_size) {
-        printk(KERN_INFO DEVICE_NAME ": <dev_read> [PID:%d] failed to send top of priority_queue due to invalid read by user proc. \n", current->pid);
+        pq_log(KERN_INFO DEVICE_NAME ": <dev_read> [PID:%d] failed to send top of priority_queue due to invalid read by user proc. \n", current->pid);
         // push_value(proc_entry->pq, pq_top_elem, pq_top_elem_pri);
         push_value(proc_entry->pq, pq_top_elem);
         return -EACCES;
     }
     pq_top_elem = pop_value(proc_entry->pq);
     
-    printk(KERN_INFO DEVICE_NAME ": <dev_read> [PID:%d] expecting %ld bytes.\n", current->pid, inbuffer_size);
+    pq_log(KERN_INFO DEVICE_NAME ": <dev_read> [PID:%d] expecting %ld bytes.\n", current->pid, inbuffer_size);
     ret = copy_to_user(inbuffer, (int32_t*)&pq_top_elem, inbuffer_size < sizeof(pq_top_elem) ? inbuffer_size : sizeof(pq_top_elem));
     if(ret == 0 && pq_top_elem != -INF) {
-        printk(KERN_INFO DEVICE_NAME ": <dev_read> [PID:%d] sending data [%ld bytes] with value = %d to the user proc. \n ", current->pid, sizeof(pq_top_elem), pq_top_elem);
+        pq_log(KERN_INFO DEVICE_NAME ": <dev_read> [PID:%d] sending data [%ld bytes] with value = %d to the user proc. \n ", current->pid, sizeof(pq_top_elem), pq_top_elem);
         return sizeof(pq_top_elem);
     } else {
-        printk(KERN_INFO DEVICE_NAME ": <dev_read> [PID:%d] failed to send to the user proc.\n", current->pid );
+        pq_log(KERN_INFO DEVICE_NAME ": <dev_read> [PID:%d] failed to send to the user proc.\n", current->pid );
         return -EACCES;
     }
 }
@@ -382,21 +426,28 @@ static ssize_t dev_read(struct file* file, char* inbuffer, size_t inbuffer_size,
 
 static int dev_open(struct inode* inode, struct file* file) {
     hashtable* proc_entry;
-    if(get_hashtable_entry(current->pid) != NULL) {
-        printk(KERN_ALERT DEVICE_NAME ": <dev_open> [PID:%d] process tried to open file twice.\n", current->pid);
-        return -EACCES;
-    }
 
     proc_entry = (hashtable *)kmalloc(sizeof(hashtable), GFP_KERNEL);
-    *proc_entry = (hashtable) {current->pid, NULL, NULL};
-
+    if(proc_entry == NULL) {
+        printk(KERN_ALERT DEVICE_NAME ": <dev_open> [PID:%d] insufficient memory for hashtable entry.\n", current->pid);
+        return -ENOMEM;
+    }
+    proc_entry->key = current->pid;
+    proc_entry->pq = NULL;
 
     spin_lock(&pq_mutex);
-    printk(DEVICE_NAME ": <dev_open> [PID:%d] adding %d to hashtable.\n", current->pid, proc_entry->key);
+    if(get_hashtable_entry(current->pid) != NULL) {
+        spin_unlock(&pq_mutex);
+        kfree(proc_entry);
+        pq_log(KERN_ALERT DEVICE_NAME ": <dev_open> [PID:%d] process tried to open file twice.\n", current->pid);
+        return -EACCES;
+    }
+
+    pq_log(KERN_INFO DEVICE_NAME ": <dev_open> [PID:%d] adding %d to hashtable.\n", current->pid, proc_entry->key);
     add_process_entry(proc_entry);
 
     num_open_processes ++;
-    printk(KERN_INFO DEVICE_NAME ": <dev_open> [PID:%d] device openend by %d proc(s). \n", current->pid, num_open_processes);
+    pq_log(KERN_INFO DEVICE_NAME ": <dev_open> [PID:%d] device openend by %d proc(s). \n", current->pid, num_open_processes);
     print_all_processes();
     spin_unlock(&pq_mutex);
     return 0;
@@ -406,7 +457,7 @@ static int dev_release(struct inode* inode, struct file* file) {
     spin_lock(&pq_mutex);
     remove_process_entry(current->pid);
     num_open_processes--;
-    printk(KERN_INFO DEVICE_NAME ": <dev_released> [PID:%d] closed device. device currently opened by %d proc(s). \n", current->pid, num_open_processes);
+    pq_log(KERN_INFO DEVICE_NAME ": <dev_released> [PID:%d] closed device. device currently opened by %d proc(s). \n", current->pid, num_open_processes);
     print_all_processes();
     spin_unlock(&pq_mutex);
     return 0;
@@ -416,21 +467,16 @@ static int launch_module(void) {
     struct proc_dir_entry *proc_entry = proc_create(DEVICE_NAME, 0, NULL, &file_ops);
     if(!proc_entry) return -ENOENT;
 
-    htable = kmalloc(sizeof(hashtable), GFP_KERNEL);
-    if(htable == NULL) {
-        printk(KERN_ALERT DEVICE_NAME ": <LKM_init_module> insufficient memory.\n");
-        return -ENOMEM;
-    }
+    if(debug) static_branch_enable(&pq_debug_key);
 
-    *htable = (hashtable) {-1, NULL, NULL};
     printk(KERN_INFO DEVICE_NAME ": <LKM_init_module> priority_queue LKM initialized.\n");
     spin_lock_init(&pq_mutex);
     return 0;
 }
 
 static void land_module(void) {
-    destroy_hashtable();
     remove_proc_entry(DEVICE_NAME, NULL);
+    destroy_hashtable();
     printk(KERN_INFO DEVICE_NAME ": <LKM_exit_module> priority_queue LKM terminated.\n");
 }
 
@@ -3,17 +3,37 @@
  * @authors : D. Saha(19CS30014)  -&-  P. Godhani(19CS10048)
  * @brief : an LKM that supports various ioctl calls to set and retrieve various configurations and internal information respectively
  * @version : 1.0
+ * @note : needs a kernel from 5.6 on (struct proc_ops); the interfaces that changed since are picked by LINUX_VERSION_CODE
  */
 
 #include <linux/init.h>
 #include <linux/module.h>
 #include <linux/proc_fs.h>
+#include <linux/fs.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
 #include <linux/uaccess.h>
 #include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
+#include <linux/bitmap.h>
+#include <linux/sort.h>
+#include <linux/cache.h>
 #include <linux/mutex.h>
+#include <linux/rwsem.h>
+#include <linux/kref.h>
+#include <linux/err.h>
+#include <linux/llist.h>
+#include <linux/stringhash.h>
+#include <linux/jump_label.h>
+#include <linux/random.h>
 #include <linux/sched.h>
 #include <linux/kernel.h>
 #include <linux/ioctl.h>
+#include <linux/hashtable.h>
+#include <linux/version.h>
 
 /* ioctl commands */
 #define PB2_SET_CAPACITY    _IOW(0x10, 0x31, int32_t*)
@@ -22,6 +42,37 @@
 #define PB2_GET_INFO        _IOR(0x10, 0x34, int32_t*)
 #define PB2_GET_MIN         _IOR(0x10, 0x35, int32_t*)
 #define PB2_GET_MAX         _IOR(0x10, 0x36, int32_t*)
+#define PB2_EXEC_BATCH      _IOWR(0x10, 0x37, int32_t*)
+#define PB2_CREATE_SHARED   _IOW(0x10, 0x38, int32_t*)
+#define PB2_ATTACH_SHARED   _IOW(0x10, 0x39, int32_t*)
+#define PB2_DETACH_SHARED   _IO(0x10, 0x3A)
+#define PB2_WAIT_POP        _IOWR(0x10, 0x3B, int32_t*)
+#define PB2_RING_SETUP      _IOWR(0x10, 0x3C, int32_t*)
+#define PB2_RING_ENTER      _IO(0x10, 0x3D)
+#define PB2_PEEK_MIN        _IOR(0x10, 0x3E, int32_t*)
+#define PB2_PEEK_MAX        _IOR(0x10, 0x3F, int32_t*)
+#define PB2_TOP_K           _IOWR(0x10, 0x40, int32_t*)
+#define PB2_INSERT_HANDLE   _IOWR(0x10, 0x41, int32_t*)
+#define PB2_UPDATE_HANDLE   _IOW(0x10, 0x42, int32_t*)
+#define PB2_DELETE_HANDLE   _IOWR(0x10, 0x43, int32_t*)
+#define PB2_BULK_LOAD       _IOW(0x10, 0x44, int32_t*)
+#define PB2_SET_CONFIG      _IOW(0x10, 0x45, int32_t*)
+#define PB2_CREATE_SHARED_CONFIG _IOW(0x10, 0x46, int32_t*)
+
+/* opcodes of the pb2_cmd entries executed by PB2_EXEC_BATCH */
+#define PB2_OP_INSERT       1   /* insert (value, priority) */
+#define PB2_OP_POP_MIN      2   /* pop the min, result holds its (value, priority) */
+#define PB2_OP_POP_MAX      3   /* pop the max, result holds its (value, priority) */
+#define PB2_OP_PEEK_MIN     4   /* (value, priority) of the min, the queue is left untouched */
+#define PB2_OP_PEEK_MAX     5   /* (value, priority) of the max, the queue is left untouched */
+#define PB2_OP_GET_INFO     6   /* result value = current size, result priority = capacity */
+
+/* queue modes selected by PB2_SET_CONFIG */
+#define PB2_MODE_HEAP       0   /* min-max heap, any non-negative priority (the mode of PB2_SET_CAPACITY) */
+#define PB2_MODE_BUCKET     1   /* one FIFO per priority, priorities below pb2_config.param */
+#define PB2_MODE_RADIX      2   /* radix heap, priorities may not go below the last popped minimum */
+#define PB2_MODE_MULTI      3   /* relaxed order over pb2_config.param heaps, shared queues only */
+#define PB2_MODE_SKIP       4   /* skiplist popped without a lock, no pop-max, shared queues only */
 
 #define DEVICE_NAME "CS60038_a2_Grp7"
 
@@ -31,9 +82,113 @@
 #define current get_current()
 #define INF 1000000000
 
+/* number of buckets in the process table is 2^HTABLE_BITS */
+#define HTABLE_BITS 10
+
+/* number of buckets in the shared queue table is 2^SHARED_HTABLE_BITS */
+#define SHARED_HTABLE_BITS 6
+
+/* size of a shared queue name, terminating NUL included */
+#define PQ_NAME_LEN 32
+
+/* largest number of entries of a submission / completion ring */
+#define PB2_RING_MAX_ENTRIES 65536
+
+/* mmap() offset of the submission / completion rings of a file */
+#define PB2_RING_OFFSET 0
+
+/* mmap() offset of the read-only pb2_top page of the file's queue, past the largest ring mapping */
+#define PB2_TOP_OFFSET 0x10000000
+
+/* number of slots the element array starts with (and never shrinks below) */
+#define PQ_MIN_ALLOC 64
+
+/* the heap is PQ_ARITY-ary : node i has children PQ_ARITY * i + 1 ... PQ_ARITY * i + PQ_ARITY */
+#define PQ_ARITY_BITS 2
+#define PQ_ARITY (1 << PQ_ARITY_BITS)
+
+/* children plus grandchildren of a node, the nodes a trickle-down step looks at */
+#define PQ_FANOUT (PQ_ARITY + PQ_ARITY * PQ_ARITY)
+
+/* largest number of priority levels of a PB2_MODE_BUCKET queue */
+#define PQ_BUCKET_MAX_LEVELS (1 << 16)
+
+/* buckets of a PB2_MODE_RADIX queue : bucket 0 holds the priorities equal to the last popped minimum,
+ * bucket b the ones whose highest bit differing from it is bit b - 1 (priorities are below 2^31) */
+#define PQ_RADIX_BUCKETS 32
+
+/* largest number of shards of a PB2_MODE_MULTI queue */
+#define PQ_MULTI_MAX_SHARDS 1024
+
+/* random shards a PB2_MODE_MULTI insert or pop tries to lock before it waits for a lock */
+#define PQ_MULTI_TRIES 4
+
+/* passes a combiner makes over the publication list of a shared queue before it lets go of the lock */
+#define PQ_COMBINE_PASSES 4
+
+/* polls of its request a poster makes while another thread holds the lock, before it blocks on the lock */
+#define PQ_COMBINE_SPINS 1024
+
+/* opcode of the combined requests feeding the 4-byte insert protocol, never accepted from the user */
+#define PQ_OP_PUSH_VALUE 0
+
+/* tallest tower of a PB2_MODE_SKIP node, a tower grows one more level with probability 1/2 */
+#define PQ_SKIP_LEVELS 24
+
+/* deleted nodes a PB2_MODE_SKIP pop may walk over before it unlinks them */
+#define PQ_SKIP_BOUND 32
+
+/* number of records copied from a batched write() per copy_from_user */
+#define PQ_BATCH_CHUNK 32
+
+/* internal result of the blocking pops, never handed to the user : the file was attached to another queue while
+ * the caller slept on the old one, it starts over on the new one */
+#define PQ_SWITCHED (-MAX_ERRNO - 1)
+
+/* hard bound on max_capacity : the widest per element array (pq_node, a bulk load's records and their keys, or
+ * a top-k's records and candidates) stays below INT_MAX bytes, the most kvmalloc accepts, and doubling an alloc
+ * cannot overflow int32_t */
+#define PQ_CAPACITY_LIMIT (INT_MAX / 16)
+
 MODULE_AUTHOR("PRIT_BOB");
 MODULE_LICENSE("GPL");
 
+/* largest capacity a process may ask for, the element array only grows up to it on demand */
+static int max_capacity = 1 << 24;
+module_param(max_capacity, int, 0644);
+MODULE_PARM_DESC(max_capacity, "largest priority_queue capacity accepted (default 16777216, at most 134217727)");
+
+/* per-operation logging is patched out by a static key unless the debug parameter is set */
+static DEFINE_STATIC_KEY_FALSE(pq_debug_key);
+static bool debug;
+
+static int debug_param_set(const char *val, const struct kernel_param *kp){
+    int ret = param_set_bool(val, kp);
+
+    if(ret == 0){
+        if(debug)
+            static_branch_enable(&pq_debug_key);
+        else
+            static_branch_disable(&pq_debug_key);
+    }
+    return ret;
+}
+
+static const struct kernel_param_ops debug_param_ops = {
+    .set = debug_param_set,
+    .get = param_get_bool,
+};
+module_param_cb(debug, &debug_param_ops, &debug, 0644);
+MODULE_PARM_DESC(debug, "log every queue operation to the kernel ring buffer (default N)");
+
+/* the single element ioctls of a strict shared queue go through its publication list, unless combine is cleared */
+static bool flat_combine = true;
+module_param_named(combine, flat_combine, bool, 0644);
+MODULE_PARM_DESC(combine, "run the single element ioctls of shared queues through a flat combiner (default Y)");
+
+#define pq_log(...) \
+    do { if(static_branch_unlikely(&pq_debug_key)) printk(__VA_ARGS__); } while(0)
+
 
 typedef struct _obj_info {
 	int32_t prio_que_size; 	// current number of elements in priority-queue
@@ -41,17 +196,235 @@ typedef struct _obj_info {
 } obj_info;
 
 /* Data structure definitions */
-/* Data struct that is stored in the priority_queue */
+/* one element of the priority_queue, unpacked from its key and item by read_element() */
 typedef struct _data {
     int32_t value;
     int32_t priority;
     int32_t in_time;
+    int32_t slot;           /* entry of pq->slots that tracks the position of the element */
 } data;
 
+/* payload of an element, kept apart from the keys so that comparisons only touch the key array */
+typedef struct _pq_item {
+    int32_t value;
+    int32_t slot;           /* entry of pq->slots that tracks the position of the element */
+} pq_item;
+
+/* handle table entry, the handle of an element is (gen << 32) | slot */
+typedef struct _pq_slot {
+    int32_t index;          /* position of the element in the heap while it is queued, next free slot otherwise */
+    uint32_t gen;           /* handle_seq of the last element that took the slot, stale handles do not match it */
+} pq_slot;
+
+/* record layout of a batched write() : N of these packed back to back */
+typedef struct _pq_record {
+    int32_t value;
+    int32_t priority;
+} pq_record;
+
+/* one operation of a PB2_EXEC_BATCH command buffer */
+typedef struct _pb2_cmd {
+    int32_t opcode;         /* one of PB2_OP_* */
+    int32_t value;
+    int32_t priority;
+} pb2_cmd;
+
+/* outcome of one pb2_cmd, written to the results array at the same position */
+typedef struct _pb2_result {
+    int32_t status;         /* 0 or a negative errno */
+    int32_t value;
+    int32_t priority;
+} pb2_result;
+
+/* argument of PB2_EXEC_BATCH : count commands are read from cmds and count results written to results */
+typedef struct _pb2_batch {
+    uint64_t cmds;          /* user pointer to pb2_cmd[count] */
+    uint64_t results;       /* user pointer to pb2_result[count] */
+    int32_t count;
+} pb2_batch;
+
+/* argument of PB2_CREATE_SHARED and PB2_ATTACH_SHARED */
+typedef struct _pb2_shared {
+    char name[PQ_NAME_LEN]; /* NUL terminated name of the shared queue */
+    int32_t capacity;       /* capacity of the queue to create, ignored by PB2_ATTACH_SHARED */
+} pb2_shared;
+
+/* argument of PB2_TOP_K : the k smallest elements are copied to records in priority order */
+typedef struct _pb2_top_k {
+    uint64_t records;       /* user pointer to pq_record[k] */
+    int32_t k;
+} pb2_top_k;
+
+/* argument of PB2_INSERT_HANDLE, PB2_UPDATE_HANDLE and PB2_DELETE_HANDLE */
+typedef struct _pb2_handle_op {
+    uint64_t handle;        /* returned by PB2_INSERT_HANDLE, names the element for the other two */
+    int32_t value;          /* in : PB2_INSERT_HANDLE, out : PB2_DELETE_HANDLE */
+    int32_t priority;       /* in : PB2_INSERT_HANDLE and the new priority of PB2_UPDATE_HANDLE, out : PB2_DELETE_HANDLE */
+} pb2_handle_op;
+
+/* argument of PB2_BULK_LOAD : count records are added to the queue at once */
+typedef struct _pb2_bulk {
+    uint64_t records;       /* user pointer to pq_record[count] */
+    int32_t count;
+} pb2_bulk;
+
+/* argument of PB2_SET_CONFIG : empties the queue like PB2_SET_CAPACITY and switches it to the given mode */
+typedef struct _pb2_config {
+    int32_t capacity;
+    int32_t mode;           /* one of PB2_MODE_* */
+    int32_t param;          /* PB2_MODE_BUCKET : number of priority levels, PB2_MODE_MULTI : number of shards (0 for
+                               two per online CPU), ignored by PB2_MODE_HEAP, PB2_MODE_RADIX and PB2_MODE_SKIP */
+} pb2_config;
+
+/* argument of PB2_CREATE_SHARED_CONFIG : a pb2_shared followed by the mode and param of a pb2_config */
+typedef struct _pb2_shared_config {
+    char name[PQ_NAME_LEN];
+    int32_t capacity;
+    int32_t mode;
+    int32_t param;
+} pb2_shared_config;
+
+/* argument of PB2_WAIT_POP : pops the min or the max, sleeping up to timeout_ms for an element */
+typedef struct _pb2_wait_pop {
+    int32_t opcode;         /* PB2_OP_POP_MIN or PB2_OP_POP_MAX */
+    int32_t timeout_ms;     /* < 0 waits forever, 0 does not wait */
+    int32_t value;          /* out : value of the popped element */
+    int32_t priority;       /* out : priority of the popped element */
+} pb2_wait_pop;
+
+/* argument of PB2_RING_SETUP : entries goes in, the layout of the mapping comes out */
+typedef struct _pb2_ring_info {
+    int32_t entries;        /* slots in each ring, a power of 2 */
+    uint32_t sq_off;        /* offset of pb2_cmd[entries] in the mapping */
+    uint32_t cq_off;        /* offset of pb2_result[entries] in the mapping */
+    uint32_t size;          /* length to mmap() at PB2_RING_OFFSET */
+} pb2_ring_info;
+
+/** header at the start of the ring mapping, the four indexes sit on their own cache lines
+ * @note the user produces requests at sq_tail and consumes results at cq_head, the kernel moves
+ * sq_head and cq_tail; indexes run freely and are masked with entries - 1 on access.
+ * A request is published with a release store of sq_tail, a result with a release store of cq_tail.
+ */
+typedef struct _pb2_ring_hdr {
+    uint32_t sq_head;
+    uint32_t pad0[15];
+    uint32_t sq_tail;
+    uint32_t pad1[15];
+    uint32_t cq_head;
+    uint32_t pad2[15];
+    uint32_t cq_tail;
+    uint32_t pad3[15];
+} pb2_ring_hdr;
+
+/** snapshot of a queue exposed read-only at PB2_TOP_OFFSET, rewritten by every operation that changes the queue
+ * @note seq is odd while the snapshot is being rewritten : a reader loads seq (acquire), retries while it is odd,
+ * reads the fields, then retries if seq changed after a read barrier. min / max are only valid when count > 0.
+ */
+typedef struct _pb2_top {
+    uint32_t seq;
+    int32_t count;
+    int32_t capacity;
+    int32_t min_value;
+    int32_t min_priority;
+    int32_t max_value;
+    int32_t max_priority;
+} pb2_top;
+
+/* element of a PB2_MODE_BUCKET or PB2_MODE_RADIX queue, chained into the FIFO of its bucket */
+typedef struct _pq_node {
+    int32_t value;
+    int32_t priority;       /* PB2_MODE_RADIX only, a PB2_MODE_BUCKET bucket holds a single priority */
+    int32_t prev;           /* older element of the same bucket, -1 at the head */
+    int32_t next;           /* newer element of the same bucket, -1 at the tail; next free node while unused */
+} pq_node;
+
+/* FIFO of one bucket of a PB2_MODE_BUCKET or PB2_MODE_RADIX queue */
+typedef struct _pq_bucket {
+    int32_t head;           /* oldest element, -1 while the bucket is empty */
+    int32_t tail;           /* newest element */
+} pq_bucket;
+
+struct _priority_queue;
+
+/* element of a PB2_MODE_SKIP queue, freed after an RCU grace period since pops walk the list without a lock */
+/** @note bit 0 of next[0] marks the next node as deleted (the scheme of Lindén and Jonsson), so the deleted
+ * nodes are a prefix of level 0; deleted is set once the mark is, as a hint for the walks on the upper levels
+ */
+typedef struct _pq_skip_node {
+    uint64_t key;           /* make_key(priority, in_time) */
+    int32_t value;
+    int32_t height;         /* number of levels the node may be linked on */
+    int32_t deleted;
+    struct rcu_head rcu;
+    unsigned long next[];   /* next node on each level, the upper levels only change under skip_lock */
+} pq_skip_node;
+
+/* shard of a PB2_MODE_MULTI queue, alone on its cache line since every sampler reads it */
+/** @note count and the priorities at the two ends are republished under the shard's lock after every change,
+ * and read without it to pick a shard : they are only a hint until the lock is taken
+ */
+typedef struct _pq_shard {
+    struct _priority_queue *pq; /* PB2_MODE_HEAP queue holding the elements of the shard */
+    int32_t count;
+    int32_t min_priority;   /* -1 while the shard is empty */
+    int32_t max_priority;
+} ____cacheline_aligned_in_smp pq_shard;
+
+/* single element ioctl posted to the publication list of a shared queue, lives on the poster's stack */
+/** @note the combiner fills res and then releases done : the poster may return as soon as it sees it,
+ * so the combiner never touches the request after that
+ */
+typedef struct _pq_combine_req {
+    struct llist_node node;
+    pb2_cmd cmd;            /* PB2_OP_* run by exec_cmd, or PQ_OP_PUSH_VALUE feeding cmd.value to push_value */
+    pb2_result res;
+    int32_t done;
+} pq_combine_req;
+
+/* backend of a queue mode, the generic code only reaches the elements through it */
+/** @note every hook runs with pq->lock held; pop and peek are only called on a non-empty queue,
+ * push and bulk_load after the generic capacity and priority < 0 checks
+ * @note a concurrent backend (PB2_MODE_MULTI, PB2_MODE_SKIP) takes its own locks : it leaves pop, peek and
+ * top_k NULL and provides the try_* hooks instead, see pq_is_concurrent and concurrent_ioctl
+ */
+typedef struct _pq_ops {
+    /* allocates the storage of an empty queue, then releases the previous backend's : a failure leaves the queue as it was */
+    int32_t (*setup)(struct _priority_queue *pq, int32_t capacity, int32_t param);
+    void (*release)(struct _priority_queue *pq);
+    /* @return : >= 0 (the handle slot for the heap), or a negative errno */
+    int32_t (*push)(struct _priority_queue *pq, int32_t value, int32_t priority);
+    void (*pop)(struct _priority_queue *pq, int32_t is_max, data *out);
+    void (*peek)(struct _priority_queue *pq, int32_t is_max, data *out);
+    /* see peek_top_k for the size of cand */
+    int32_t (*top_k)(struct _priority_queue *pq, pq_record *out, int32_t *cand, int32_t k);
+    /* all or nothing, @return : bulk->count or a negative errno */
+    int32_t (*bulk_load)(struct _priority_queue *pq, const pb2_bulk *bulk);
+    /* concurrent backends only, called without pq->lock : 0, or -EAGAIN on an empty queue */
+    int32_t (*try_pop)(struct _priority_queue *pq, int32_t is_max, data *out);
+    int32_t (*try_peek)(struct _priority_queue *pq, int32_t is_max, data *out);
+    int32_t (*count)(struct _priority_queue *pq);
+    /* the k smallest elements in priority order, called with pq->lock held */
+    int32_t (*collect)(struct _priority_queue *pq, pq_record *out, int32_t k);
+} pq_ops;
+
 /* priority_queue struct */
+/** @note every field below lock up to ref is guarded by it; a private queue lives as long as the open file
+ * and PB2_SET_CAPACITY only swaps its element array under the lock, a shared queue lives until its last
+ * attached file lets go of it
+ * @note the value -> priority state of the 4-byte write()/PB2_INSERT_* protocol belongs to the queue, so
+ * processes sharing a queue should insert with batched writes or PB2_EXEC_BATCH instead
+ */
 typedef struct _priority_queue{
-    data *arr;
-    int32_t capacity;
+    struct mutex lock;      /* serializes all operations on this queue */
+    const pq_ops *ops;      /* backend of the mode below */
+    int32_t mode;           /* one of PB2_MODE_* */
+    /* PB2_MODE_HEAP : the heap is split in two arrays indexed alike, keys[i] = priority << 32 | in_time
+     * orders element i and items[i] holds the rest of it */
+    uint64_t *keys;
+    pq_item *items;
+    void *key_mem;          /* allocation keys points into, see alloc_keys */
+    int32_t alloc;          /* number of slots allocated in keys and items, grows and shrinks with count */
+    int32_t capacity;       /* maximum number of elements as set by the user, 0 until then */
     int32_t count;
     int32_t timer;
     /* 
@@ -59,46 +432,209 @@ typedef struct _priority_queue{
      * 2 = To be read => priority
      */
     int32_t input_state;
+    int32_t pending_value;  /* value waiting for its priority while input_state == 2 */
+    /* handle table : one slot per queued element, freed slots are chained through their index */
+    pq_slot *slots;
+    int32_t slot_alloc;     /* number of slots allocated, grows up to the capacity and never shrinks */
+    int32_t slot_used;      /* slots handed out so far, the rest of the table is untouched */
+    int32_t free_slot;      /* head of the free slot chain, -1 if empty */
+    uint32_t handle_seq;    /* generation of the next handle, kept across PB2_SET_CAPACITY */
+    /* PB2_MODE_BUCKET : a FIFO per priority and a two level bitmap of the non-empty ones,
+     * PB2_MODE_RADIX : PQ_RADIX_BUCKETS FIFOs and the bitmap of the non-empty ones */
+    pq_bucket *buckets;
+    unsigned long *bucket_bits;     /* bit p set iff buckets[p] is non-empty */
+    unsigned long *bucket_summary;  /* bit w set iff bucket_bits[w] is non-zero */
+    int32_t levels;         /* priorities accepted are [0, levels) */
+    pq_node *nodes;
+    int32_t node_alloc;     /* number of nodes allocated, grows up to the capacity and never shrinks */
+    int32_t node_used;      /* nodes handed out so far, the rest of the array is untouched */
+    int32_t free_node;      /* head of the free node chain, -1 if empty */
+    int32_t radix_last;     /* PB2_MODE_RADIX : last popped minimum, the floor of the accepted priorities */
+    /* PB2_MODE_MULTI : the elements live in the shards, each behind its own lock; lock only guards the
+     * 4-byte insert protocol and the top page, and is taken before any shard lock */
+    pq_shard *shards;
+    void *shard_mem;        /* allocation shards points into, aligned like alloc_keys does */
+    int32_t nr_shards;
+    /* PB2_MODE_SKIP : a skiplist, inserts hold skip_lock and pops claim the first node without any lock;
+     * timer is guarded by skip_lock instead of lock */
+    pq_skip_node *skip_head;    /* sentinel, PQ_SKIP_LEVELS high */
+    struct mutex skip_lock;     /* serializes the inserts and the unlinking of deleted nodes, nests in lock */
+    atomic_t skip_count;
+    /* shared queues other than PB2_MODE_MULTI : requests waiting for a combiner, see combine_cmd */
+    struct llist_head combine;
+    wait_queue_head_t wait; /* readers sleeping for an element, pollers waiting for an element or room */
+    struct rcu_head rcu;    /* pollers may still hold wait when a detached shared queue is freed */
+    pb2_top *top;           /* page mapped by the users of the queue, NULL until the first mmap() of it */
+    /* shared queues only, guarded by pq_mutex */
+    struct kref ref;        /* one reference per file attached to the queue */
+    char name[PQ_NAME_LEN]; /* empty for the private queue of a file */
+    struct hlist_node node; /* links the queue into shared_queues */
 } priority_queue;
 
-/* hashtable struct that maps individual priority_queue's to processes using PID's */
+/* hashtable entry for one open file of the device, the file reaches it through file->private_data */
+/** @note pq is the queue every operation of the file goes to : the file's own queue, or the shared
+ * queue it is attached to. It is only switched with attach_sem held for write, operations hold it for read,
+ * except the pops that may sleep, which pin the queue instead (see pin_entry_queue).
+ */
 typedef struct hashtable{
-    int key;
+    int key;                /* PID of the opener, only used for bookkeeping */
     priority_queue *pq;
-    struct hashtable *next;
+    priority_queue *own;    /* private queue created at open, kept while attached to a shared one */
+    struct rw_semaphore attach_sem;
+    /* submission / completion rings shared with the user through mmap(), NULL until PB2_RING_SETUP */
+    struct mutex ring_lock; /* serializes the kernel side of the rings */
+    pb2_ring_hdr *ring;
+    pb2_cmd *ring_sq;
+    pb2_result *ring_cq;
+    uint32_t ring_entries;
+    uint32_t ring_size;
+    uint32_t ring_sq_head;  /* kernel copies of the indexes it owns, the user may scribble on the mapped ones */
+    uint32_t ring_cq_tail;
+    struct hlist_node node;
 } hashtable;
 
-// A spinlock to avoid concurrency issues when the global hashtable is accessed/modified.
+/* what one open() allocates : the hashtable entry and the private queue of the file, in a single
+ * pq_file_cache object whose entry.own points at queue */
+typedef struct _pq_file {
+    hashtable entry;
+    priority_queue queue;
+} pq_file;
+
+/* headers of the shared queues and of the shards of PB2_MODE_MULTI, cache aligned so that the locks
+ * of two queues taken on different CPUs never share a line */
+static struct kmem_cache *pq_cache;
+/* one pq_file per open file, cache aligned likewise */
+static struct kmem_cache *pq_file_cache;
+
+// A spinlock to avoid concurrency issues when the global hashtables are modified.
 static DEFINE_SPINLOCK(pq_mutex);
 
-// Global hashtable that maps pid's to priority_queues
-struct hashtable *htable;
+// Global hashtable of all open files of the device, hashed on the opener's pid
+static DEFINE_HASHTABLE(htable, HTABLE_BITS);
+
+// Global hashtable of the shared queues, hashed on their name
+static DEFINE_HASHTABLE(shared_queues, SHARED_HTABLE_BITS);
 
 // Global variable to keep track of the number of process currently using the LKM 
 static int num_open_processes = 0;
 
 /* Priority Queue Methods */
-static priority_queue* init_priority_queue(int32_t capacity);
+static priority_queue* init_priority_queue(void);
+static void init_queue_header(priority_queue *pq);
+static int32_t configure_priority_queue(priority_queue *pq, int32_t capacity, int32_t mode, int32_t param);
 static priority_queue* destroy_priority_queue(priority_queue* pq);
+static void release_priority_queue(priority_queue *pq);
+static inline int32_t pq_is_ready(priority_queue *pq);
+static int32_t resize_priority_queue(priority_queue *pq, int32_t alloc);
+static int32_t valid_capacity(int32_t capacity);
+static void shrink_priority_queue(priority_queue *pq);
 static int32_t push_value(priority_queue *pq, int32_t num);
+static int32_t push_element(priority_queue *pq, int32_t value, int32_t priority);
+static int32_t alloc_slot(priority_queue *pq);
+static int32_t grow_slots(priority_queue *pq, int32_t need);
+static int32_t bulk_load(priority_queue *pq, const pb2_bulk *bulk);
+static void pop_element(priority_queue *pq, int32_t is_max, data *out);
+static void peek_element(priority_queue *pq, int32_t is_max, data *out);
+/* PB2_MODE_HEAP backend */
+static int32_t heap_setup(priority_queue *pq, int32_t capacity, int32_t param);
+static void heap_release(priority_queue *pq);
+static int32_t heap_push(priority_queue *pq, int32_t value, int32_t priority);
+static void heap_pop(priority_queue *pq, int32_t is_max, data *out);
+static void heap_peek(priority_queue *pq, int32_t is_max, data *out);
+static int32_t heap_bulk_load(priority_queue *pq, const pb2_bulk *bulk);
+/* PB2_MODE_BUCKET backend */
+static int32_t bucket_setup(priority_queue *pq, int32_t capacity, int32_t levels);
+static void bucket_release(priority_queue *pq);
+static int32_t bucket_push(priority_queue *pq, int32_t value, int32_t priority);
+static void bucket_pop(priority_queue *pq, int32_t is_max, data *out);
+static void bucket_peek(priority_queue *pq, int32_t is_max, data *out);
+static int32_t bucket_top_k(priority_queue *pq, pq_record *out, int32_t *cand, int32_t k);
+static int32_t bucket_bulk_load(priority_queue *pq, const pb2_bulk *bulk);
+static int32_t grow_nodes(priority_queue *pq, int32_t need);
+static int32_t staged_bulk_load(priority_queue *pq, const pb2_bulk *bulk, int32_t (*check)(priority_queue *, int32_t));
+/* PB2_MODE_RADIX backend */
+static int32_t radix_setup(priority_queue *pq, int32_t capacity, int32_t param);
+static int32_t radix_push(priority_queue *pq, int32_t value, int32_t priority);
+static void radix_pop(priority_queue *pq, int32_t is_max, data *out);
+static void radix_peek(priority_queue *pq, int32_t is_max, data *out);
+static int32_t radix_top_k(priority_queue *pq, pq_record *out, int32_t *cand, int32_t k);
+static int32_t radix_bulk_load(priority_queue *pq, const pb2_bulk *bulk);
+/* PB2_MODE_MULTI backend */
+static int32_t multi_setup(priority_queue *pq, int32_t capacity, int32_t param);
+static void multi_release(priority_queue *pq);
+static int32_t multi_push(priority_queue *pq, int32_t value, int32_t priority);
+static int32_t multi_pop(priority_queue *pq, int32_t is_max, data *out);
+static int32_t multi_peek(priority_queue *pq, int32_t is_max, data *out);
+static int32_t multi_count(priority_queue *pq);
+static int32_t multi_top_k(priority_queue *pq, pq_record *out, int32_t k);
+static int32_t multi_bulk_load(priority_queue *pq, const pb2_bulk *bulk);
+static long concurrent_wait_pop(hashtable *entry, priority_queue *pq, int32_t is_max, long *timeout, data *out);
+static int32_t concurrent_pop_values(hashtable *entry, priority_queue *pq, int32_t *out, int32_t n, long *timeout);
+static inline int32_t pq_is_concurrent(priority_queue *pq);
+/* PB2_MODE_SKIP backend */
+static int32_t skip_setup(priority_queue *pq, int32_t capacity, int32_t param);
+static void skip_release(priority_queue *pq);
+static int32_t skip_push(priority_queue *pq, int32_t value, int32_t priority);
+static int32_t skip_pop(priority_queue *pq, int32_t is_max, data *out);
+static int32_t skip_peek(priority_queue *pq, int32_t is_max, data *out);
+static int32_t skip_count(priority_queue *pq);
+static int32_t skip_top_k(priority_queue *pq, pq_record *out, int32_t k);
+static int32_t skip_bulk_load(priority_queue *pq, const pb2_bulk *bulk);
+static inline int32_t queue_count(priority_queue *pq);
+static int32_t heap_reserve(priority_queue *pq, int32_t n);
+static int32_t find_handle(priority_queue *pq, uint64_t handle);
+static void repair_index(priority_queue *pq, int32_t index);
+static int32_t push_records(priority_queue *pq, const pq_record *recs, int32_t n);
 static int32_t pop_value(priority_queue *pq);
 static int32_t pop_max_value(priority_queue *pq);
+static int32_t pop_values(priority_queue *pq, int32_t *out, int32_t n);
+static int32_t max_index(priority_queue *pq);
+static void pop_index(priority_queue *pq, int32_t index, data *out);
+static void read_element(priority_queue *pq, int32_t index, data *out);
+static int32_t exec_batch(priority_queue *pq, const pb2_batch *batch);
+static inline int32_t pq_combines(priority_queue *pq);
+static void combine_cmd(priority_queue *pq, const pb2_cmd *cmd, pb2_result *res);
+static int32_t peek_top_k(priority_queue *pq, pq_record *out, int32_t *cand, int32_t k);
+static void wake_priority_queue(priority_queue *pq);
+static void update_top_page(priority_queue *pq);
+static void refresh_top_page(priority_queue *pq);
+static pb2_top* map_top_page(priority_queue *pq);
+static int32_t setup_ring(hashtable *entry, pb2_ring_info *info);
+static int32_t drain_ring(hashtable *entry, priority_queue *pq);
+static int32_t enter_ring(hashtable *entry, priority_queue *pq);
+static long wait_for_element(hashtable *entry, priority_queue *pq, long *timeout);
 static void heapify_bottom_top(priority_queue *pq, int32_t index);
 static void heapify_top_bottom(priority_queue *pq, int32_t parent_index);
-
 /* Hashtable methods */
-static hashtable* get_hashtable_entry(int key);
 static void add_process_entry(hashtable* entry);
 static void destroy_hashtable(void);
-static void remove_process_entry(int key);
+static void remove_process_entry(hashtable* entry);
+static void free_process_entry(hashtable *entry);
 static void print_all_processes(void);
+/* Shared queue methods */
+static priority_queue* find_shared_queue(const char *name);
+static void put_shared_queue(priority_queue *pq);
+static void switch_entry_queue(hashtable *entry, priority_queue *pq);
+static priority_queue* pin_entry_queue(hashtable *entry);
+static void unpin_entry_queue(hashtable *entry, priority_queue *pq);
+static int32_t create_shared_queue(hashtable *entry, const pb2_shared_config *req);
+static int32_t attach_shared_queue(hashtable *entry, const char *name);
+static int32_t detach_shared_queue(hashtable *entry);
 
 /* API used by user process whenever they try to write to the /proc file */
 static int dev_open(struct inode *, struct file *);
 static int dev_release(struct inode *, struct file *);
 static ssize_t dev_read(struct file *, char *, size_t, loff_t *);
 static ssize_t dev_write(struct file *, const char *, size_t, loff_t *);
+static __poll_t dev_poll(struct file *, poll_table *);
+static int dev_mmap(struct file *, struct vm_area_struct *);
+static ssize_t write_locked(priority_queue *pq, const char *inbuffer, size_t inbuffer_size);
 static long dev_ioctl(struct file *, unsigned int, unsigned long);
+static long queue_ioctl(struct file *file, priority_queue *pq, unsigned int command, unsigned long arg);
+static long shared_ioctl(hashtable *entry, unsigned int command, unsigned long arg);
+static long ring_ioctl(hashtable *entry, unsigned int command, unsigned long arg);
+static long wait_pop_ioctl(struct file *file, hashtable *entry, unsigned long arg);
+static long concurrent_ioctl(struct file *file, priority_queue *pq, unsigned int command, unsigned long arg);
 
 /* map the /proc file function calls to the LKM functions that serve the desired input */
 static struct proc_ops file_ops =
@@ -107,491 +643,3337 @@ static struct proc_ops file_ops =
 	.proc_read = dev_read,
 	.proc_write = dev_write,
 	.proc_release = dev_release,
+    .proc_poll = dev_poll,
+    .proc_mmap = dev_mmap,
     .proc_ioctl = dev_ioctl,
 };
 
-// hashtable lookup function : returns a hashtable entry for the given pid(key)
-static hashtable* get_hashtable_entry(int key){
-    hashtable *entry = htable->next;
-    while(entry != NULL){
-        if(entry->key == key){
-            return entry;
-        }
-        entry = entry->next;
-    }
-    return NULL;
-}
+/* backends of the queue modes, indexed by PB2_MODE_* */
+static const pq_ops heap_ops = {
+    .setup = heap_setup,
+    .release = heap_release,
+    .push = heap_push,
+    .pop = heap_pop,
+    .peek = heap_peek,
+    .top_k = peek_top_k,
+    .bulk_load = heap_bulk_load,
+};
+
+static const pq_ops bucket_ops = {
+    .setup = bucket_setup,
+    .release = bucket_release,
+    .push = bucket_push,
+    .pop = bucket_pop,
+    .peek = bucket_peek,
+    .top_k = bucket_top_k,
+    .bulk_load = bucket_bulk_load,
+};
+
+/* shares the node storage of the bucket mode */
+static const pq_ops radix_ops = {
+    .setup = radix_setup,
+    .release = bucket_release,
+    .push = radix_push,
+    .pop = radix_pop,
+    .peek = radix_peek,
+    .top_k = radix_top_k,
+    .bulk_load = radix_bulk_load,
+};
+
+/* the shards take their own locks */
+static const pq_ops multi_ops = {
+    .setup = multi_setup,
+    .release = multi_release,
+    .push = multi_push,
+    .bulk_load = multi_bulk_load,
+    .try_pop = multi_pop,
+    .try_peek = multi_peek,
+    .count = multi_count,
+    .collect = multi_top_k,
+};
+
+/* pops claim nodes without any lock, see the skip mode */
+static const pq_ops skip_ops = {
+    .setup = skip_setup,
+    .release = skip_release,
+    .push = skip_push,
+    .bulk_load = skip_bulk_load,
+    .try_pop = skip_pop,
+    .try_peek = skip_peek,
+    .count = skip_count,
+    .collect = skip_top_k,
+};
+
+static const pq_ops *const pq_modes[] = {
+    [PB2_MODE_HEAP] = &heap_ops,
+    [PB2_MODE_BUCKET] = &bucket_ops,
+    [PB2_MODE_RADIX] = &radix_ops,
+    [PB2_MODE_MULTI] = &multi_ops,
+    [PB2_MODE_SKIP] = &skip_ops,
+};
 
 // hashtable insert function : inserts the given entry in the hashtable
+// @note : caller must hold pq_mutex
 static void add_process_entry(hashtable* entry){
-    entry->next = htable->next;
-    htable->next = entry;
+    hash_add(htable, &entry->node, entry->key);
 }
 
 // hashtable destroy function : deletes all entries and the empties the hashtable
+// @note : the queues are freed after pq_mutex is dropped since kvfree may sleep
 static void destroy_hashtable(void){
-    hashtable *entry, *temp;
-    entry = htable->next;
-    while(entry != NULL){
-        temp = entry;
-        printk(KERN_INFO DEVICE_NAME ": <free_hashtable_entry> [key = %d]", entry->key);
-        entry = entry->next;
-        kfree(temp);
-    }
-    kfree(htable);
-}
-
-// hashtable delete function : deletes entry with the given key(pid)
-static void remove_process_entry(int key){
-    hashtable *entry = htable->next;
-    hashtable *prev = htable;
-    while(entry != NULL){
-        if(entry->key == key){
-            prev->next = entry->next;
-            destroy_priority_queue(entry->pq);
-            entry->next = NULL;
-            printk(KERN_INFO DEVICE_NAME ": <remove_process_entry> [PID:%d], [key = %d]", current->pid, entry->key);
-            kfree(entry);
-            return;
-        }
-        prev = entry;
-        entry = entry->next;
+    hashtable *entry;
+    struct hlist_node *temp;
+    HLIST_HEAD(dead);
+    int bkt;
+
+    spin_lock(&pq_mutex);
+    hash_for_each_safe(htable, bkt, temp, entry, node){
+        hash_del(&entry->node);
+        hlist_add_head(&entry->node, &dead);
+    }
+    spin_unlock(&pq_mutex);
+
+    hlist_for_each_entry_safe(entry, temp, &dead, node){
+        pq_log(KERN_INFO DEVICE_NAME ": <free_hashtable_entry> [key = %d]", entry->key);
+        free_process_entry(entry);
+    }
+}
+
+// rcu callback of free_process_entry : returns the entry and its private queue to pq_file_cache
+static void free_pq_file_rcu(struct rcu_head *head){
+    kmem_cache_free(pq_file_cache, container_of(head, pq_file, queue.rcu));
+}
+
+// hashtable entry free function : detaches the entry from its shared queue and frees it with its private queue
+// @note : the entry must already be unlinked, the pq_file goes back to its cache after an RCU grace period
+// like any queue header, see destroy_priority_queue
+static void free_process_entry(hashtable *entry){
+    if(entry->pq != entry->own){
+        put_shared_queue(entry->pq);
     }
+    release_priority_queue(entry->own);
+    mutex_destroy(&entry->ring_lock);
+    vfree(entry->ring);
+    call_rcu(&entry->own->rcu, free_pq_file_rcu);
+}
+
+// hashtable delete function : unlinks the given entry, the caller frees it and its priority_queue
+// @note : caller must hold pq_mutex
+static void remove_process_entry(hashtable* entry){
+    hash_del(&entry->node);
+    pq_log(KERN_INFO DEVICE_NAME ": <remove_process_entry> [PID:%d], [key = %d]", current->pid, entry->key);
 }
 
 // hashtable print function : print all the processes currently present in the hashtable
 static void print_all_processes(void){
-    hashtable *entry = htable->next;
+    hashtable *entry;
+    int bkt;
+
+    if(!static_branch_unlikely(&pq_debug_key)){
+        return;
+    }
+
     printk(KERN_INFO DEVICE_NAME ": <print_all_processes> Total %d processes", num_open_processes);
-    while(entry != NULL){
+    hash_for_each(htable, bkt, entry, node){
         printk(KERN_INFO DEVICE_NAME ": <print_all_processes> [PID:%d]", entry->key);
-		entry = entry->next;
     }
 }
 
-// pq init function : creates an empty priority queue
-static priority_queue* init_priority_queue(int32_t capacity){
-    priority_queue *pq = (priority_queue *)kmalloc(sizeof(priority_queue), GFP_KERNEL);
+// shared queue lookup : returns the shared queue called name, NULL if there is none
+// @note : caller must hold pq_mutex
+static priority_queue* find_shared_queue(const char *name){
+    priority_queue *pq;
 
-    // Failure Check
-    if(pq == NULL){
-        printk(KERN_ALERT DEVICE_NAME ": [PID:%d] Memory Error in allocating priority queue!", current->pid);
-		return NULL;
+    hash_for_each_possible(shared_queues, pq, node, full_name_hash(NULL, name, strlen(name))){
+        if(strcmp(pq->name, name) == 0){
+            return pq;
+        }
     }
+    return NULL;
+}
 
-    pq->capacity = capacity;
-    pq->count = 0;
-    pq->timer = 0;
-    pq->arr = (data *)kmalloc_array(capacity, sizeof(data), GFP_KERNEL);
-    pq->input_state = 1;
+// kref release callback : unlinks the shared queue, put_shared_queue frees it once pq_mutex is dropped
+// @note : called with pq_mutex held
+static void unlink_shared_queue(struct kref *ref){
+    priority_queue *pq = container_of(ref, priority_queue, ref);
 
-    //check if allocation succeed
-	if (pq->arr == NULL) {
-		printk(KERN_ALERT DEVICE_NAME ": [PID:%d] Memory Error while allocating priority queue->arr!", current->pid);
-		return NULL;
-	}
-    return pq;
+    hash_del(&pq->node);
+    pq_log(KERN_INFO DEVICE_NAME ": <unlink_shared_queue> [PID:%d] shared queue '%s' freed on last detach.\n", current->pid, pq->name);
 }
 
-// pq destroy function : deletes all nodes, and empties the priority queue
-static priority_queue* destroy_priority_queue(priority_queue* pq){
-    if(pq == NULL){
-        return pq;
+// shared queue put function : drops one reference, the last one removes and frees the queue
+static void put_shared_queue(priority_queue *pq){
+    int last;
+
+    spin_lock(&pq_mutex);
+    last = kref_put(&pq->ref, unlink_shared_queue);
+    spin_unlock(&pq_mutex);
+
+    if(last){
+        destroy_priority_queue(pq);
     }
-    printk(KERN_INFO DEVICE_NAME ": [PID:%d], %ld bytes of priority_queue->arr Space freed.\n", current->pid, sizeof(pq->arr));
-	kfree_const(pq->arr);
-	kfree_const(pq);
-    return NULL;
 }
 
-// pq insert function : insert given value in the priority_queue
-/** @note we maintain a state variable in the priority queue struct that 
- * keeps track whether the input value is a number 
- * or priority since both will be given by the user 
- * process via identical write() calls
- */
-static int32_t push_value(priority_queue *pq, int32_t num) {
-    // data d = (data){value, priority, pq->timer};
+// entry switch function : makes pq the queue of the file, dropping the reference on a previously attached shared queue
+// @note : the caller passes in the reference the file takes on a shared pq
+// @note : the blocking pops of the file sleep on the queue they pinned without attach_sem, they are woken to move on to pq
+static void switch_entry_queue(hashtable *entry, priority_queue *pq){
+    priority_queue *old;
 
-    if(pq->count >= pq->capacity){
-        return -EACCES;
+    down_write(&entry->attach_sem);
+    old = entry->pq;
+    WRITE_ONCE(entry->pq, pq);
+    up_write(&entry->attach_sem);
+
+    wake_priority_queue(old);
+    if(old != entry->own){
+        put_shared_queue(old);
     }
+}
 
-    if(pq->input_state == 1){
-        pq->arr[pq->count].value = num;
-        pq->arr[pq->count].in_time = pq->timer;
-        
-        pq->input_state = 2;
-    }else{
-        if(num < 0){
-            return -EINVAL;
-        }
-        pq->arr[pq->count].priority = num;
-        heapify_bottom_top(pq, pq->count);
-        pq->count += 1;
-        pq->timer += 1;
+// queue pin function : returns the queue of the file, kept alive until unpin_entry_queue even once attach_sem is dropped
+// @note : caller holds entry->attach_sem for read, so the file's own reference on a shared queue cannot go away
+// meanwhile; the private queue lives as long as the file and is not counted
+// @note : an operation that may sleep pins the queue instead of holding attach_sem across the sleep, a writer
+// waiting on attach_sem would otherwise block every other reader of it, the producers that would wake the sleep included
+static priority_queue* pin_entry_queue(hashtable *entry){
+    priority_queue *pq = entry->pq;
 
-        pq->input_state = 1;
+    if(pq != entry->own){
+        kref_get(&pq->ref);
+    }
+    return pq;
+}
+
+// queue unpin function : drops the reference of pin_entry_queue, the last one frees a shared queue
+static void unpin_entry_queue(hashtable *entry, priority_queue *pq){
+    if(pq != entry->own){
+        put_shared_queue(pq);
+    }
+}
+
+// shared queue create function : creates a shared queue of the given name, capacity and mode and attaches the file to it
+static int32_t create_shared_queue(hashtable *entry, const pb2_shared_config *req){
+    priority_queue *pq;
+    int32_t ret;
+
+    pq = init_priority_queue();
+    if(pq == NULL){
+        return -ENOMEM;
+    }
+    /* nobody else can see the queue yet, so it is configured without its lock */
+    ret = configure_priority_queue(pq, req->capacity, req->mode, req->param);
+    if(ret < 0){
+        destroy_priority_queue(pq);
+        return ret;
     }
+    kref_init(&pq->ref);
+    strscpy(pq->name, req->name, PQ_NAME_LEN);
+
+    spin_lock(&pq_mutex);
+    if(find_shared_queue(pq->name) != NULL){
+        spin_unlock(&pq_mutex);
+        destroy_priority_queue(pq);
+        return -EEXIST;
+    }
+    hash_add(shared_queues, &pq->node, full_name_hash(NULL, pq->name, strlen(pq->name)));
+    spin_unlock(&pq_mutex);
 
+    switch_entry_queue(entry, pq);
     return 0;
 }
 
-// pq delete function : remvoes the top element of the priority_queue
-static int32_t pop_value(priority_queue *pq){
-    data d = pq->arr[0];
+// shared queue attach function : attaches the file to the existing shared queue called name
+static int32_t attach_shared_queue(hashtable *entry, const char *name){
+    priority_queue *pq;
 
-    if(pq->count == 0){
-        return -INF;
+    spin_lock(&pq_mutex);
+    pq = find_shared_queue(name);
+    if(pq == NULL){
+        spin_unlock(&pq_mutex);
+        return -ENOENT;
     }
+    kref_get(&pq->ref);
+    spin_unlock(&pq_mutex);
 
-    pq->arr[0] = pq->arr[pq->count - 1];
-    pq->count -=1;
-    heapify_top_bottom(pq, 0);
+    switch_entry_queue(entry, pq);
+    return 0;
+}
 
-    return d.value;
+// shared queue detach function : sends the file back to its private queue
+static int32_t detach_shared_queue(hashtable *entry){
+    if(READ_ONCE(entry->pq) == entry->own){
+        return -EINVAL;
+    }
+    switch_entry_queue(entry, entry->own);
+    return 0;
 }
 
-// pq delete max function : remvoes the max element of the priority_queue
-static int32_t pop_max_value(priority_queue *pq){
-    data d = pq->arr[0];
-    int i;
-    int32_t index=0;
+/** min-max heap helpers
+ * @note nodes on even levels (root = level 0) are min levels, they are smaller than all their
+ * descendants; nodes on odd levels are max levels, they are larger than all their descendants.
+ * The smallest element is the root and the largest is one of its children, so both ends
+ * can be popped in O(log n).
+ * @note elements are ordered by their key, priority in the high half and in_time in the low half, so a
+ * smaller priority comes first and ties go to the earlier insertion with a single compare
+ */
+static inline uint64_t make_key(int32_t priority, uint32_t in_time){
+    return ((uint64_t)priority << 32) | in_time;
+}
 
-    if(pq->count == 0){
-        return -INF;
+static inline int32_t heap_parent(int32_t index){
+    return (index - 1) / PQ_ARITY;
+}
+
+static inline int32_t heap_child(int32_t index){
+    return PQ_ARITY * index + 1;
+}
+
+// level L of the heap starts at node (PQ_ARITY^L - 1) / (PQ_ARITY - 1)
+static inline int32_t is_min_level(int32_t index){
+    return ((ilog2((uint64_t)(PQ_ARITY - 1) * index + 1) / PQ_ARITY_BITS) & 1) == 0;
+}
+
+// true if key a has to sit above key b on a min (is_max = 0) or max (is_max = 1) level
+static inline int32_t key_before(uint64_t a, uint64_t b, int32_t is_max){
+    return is_max ? a > b : a < b;
+}
+
+// true if element a has to sit above element b on a min (is_max = 0) or max (is_max = 1) level
+static inline int32_t heap_before(priority_queue *pq, int32_t a, int32_t b, int32_t is_max){
+    return key_before(pq->keys[a], pq->keys[b], is_max);
+}
+
+/** hole helpers : the sifts keep the element they move in registers and shift the others into the
+ * hole it leaves, writing it back once at its final position
+ */
+static inline void heap_put(priority_queue *pq, int32_t index, uint64_t key, pq_item item){
+    pq->keys[index] = key;
+    pq->items[index] = item;
+    pq->slots[item.slot].index = index;
+}
+
+static inline void heap_move(priority_queue *pq, int32_t from, int32_t to){
+    heap_put(pq, to, pq->keys[from], pq->items[from]);
+}
+
+// swaps two elements, keeping the handle table pointing at them
+static inline void heap_swap(priority_queue *pq, int32_t a, int32_t b){
+    uint64_t key = pq->keys[a];
+    pq_item item = pq->items[a];
+
+    pq->keys[a] = pq->keys[b];
+    pq->items[a] = pq->items[b];
+    pq->keys[b] = key;
+    pq->items[b] = item;
+    pq->slots[pq->items[a].slot].index = a;
+    pq->slots[pq->items[b].slot].index = b;
+}
+
+// child selection : index of the best key (smallest on a min level, largest on a max level) among the n
+// contiguous keys starting at first
+static inline int32_t select_child(priority_queue *pq, int32_t first, int32_t n, int32_t is_max){
+    int32_t best = first;
+    int32_t i;
+
+    for(i = first + 1; i < first + n; i++){
+        if(heap_before(pq, i, best, is_max)){
+            best = i;
+        }
     }
+    return best;
+}
 
-    for(i=1; i < (pq->count);++i){
-        if(pq->arr[i].priority > d.priority){
-            d = pq->arr[i];
-            index = i;
-        }else if(pq->arr[i].priority == d.priority){
-            if(pq->arr[i].in_time > d.in_time){
-                d = pq->arr[i];
-                index = i;
-            }
+// pq descendant lookup : index of the best of the children and grandchildren of index, -1 for a leaf
+/** @note a grandchild wins ties, so a child is only returned when it is strictly better than all the
+ * grandchildren, i.e. when it has no children of its own
+ */
+static inline int32_t best_descendant(priority_queue *pq, int32_t index, int32_t is_max){
+    int32_t first = heap_child(index);
+    int32_t best, grand, n;
+
+    if(first >= pq->count){
+        return -1;
+    }
+    /* each group is contiguous and cache aligned, see alloc_keys */
+    best = select_child(pq, first, min(PQ_ARITY, pq->count - first), is_max);
+    n = min(PQ_ARITY * PQ_ARITY, pq->count - heap_child(first));
+    if(n > 0){
+        grand = select_child(pq, heap_child(first), n, is_max);
+        if(!heap_before(pq, best, grand, is_max)){
+            best = grand;
         }
     }
+    return best;
+}
 
-    pq->arr[index] = pq->arr[pq->count - 1];
-    pq->count -= 1;
-    // heapify_top_bottom(pq, index); // is it required?
-    // heapify_top_bottom(pq, index);
-    for (i = pq->count / 2 - 1; i >= 0; i--) {
-        heapify_top_bottom(pq, i);
+// pq element accessor : unpacks the element at index into out
+static void read_element(priority_queue *pq, int32_t index, data *out){
+    out->value = pq->items[index].value;
+    out->slot = pq->items[index].slot;
+    out->priority = pq->keys[index] >> 32;
+    out->in_time = (uint32_t)pq->keys[index];
+}
+
+// pq key allocator : returns an array of alloc keys whose child blocks never straddle a cache line
+/** @note the PQ_ARITY children of node i start at PQ_ARITY * i + 1; with the array shifted by PQ_ARITY - 1
+ * keys from a cache aligned base every block of siblings starts on a multiple of PQ_ARITY keys, so it shares
+ * a single line; the PQ_ARITY * PQ_ARITY grandchildren of a node, 128 bytes of keys, fill exactly two 64-byte lines
+ * @note : *mem receives the pointer to kvfree
+ */
+static uint64_t* alloc_keys(int32_t alloc, void **mem){
+    *mem = kvmalloc_array(alloc + PQ_ARITY - 1 + L1_CACHE_BYTES / sizeof(uint64_t), sizeof(uint64_t), GFP_KERNEL);
+    if(*mem == NULL){
+        return NULL;
     }
-    return d.value;
+    return (uint64_t *)PTR_ALIGN(*mem, L1_CACHE_BYTES) + PQ_ARITY - 1;
 }
 
-// pq helper function 1 : rearranges nodes to maintain priority order in the priority queue
-static void heapify_bottom_top(priority_queue *pq, int32_t index){
-    int32_t parent;
-    data temp;
-    while(index != 0){
-        parent = (index-1)/2;
-        if( (pq->arr[parent].priority > pq->arr[index].priority) 
-            ||
-            (
-                (pq->arr[index].priority == pq->arr[parent].priority)
-                &&
-                (pq->arr[parent].in_time > pq->arr[index].in_time)
-            )
-        ){
-            temp = pq->arr[parent];
-            pq->arr[parent] = pq->arr[index];
-            pq->arr[index] = temp;
-            index = parent;
-        }else{
-            break;
-        }
+// pq init function : creates an empty priority queue, unusable until configure_priority_queue sizes it
+static priority_queue* init_priority_queue(void){
+    priority_queue *pq = (priority_queue *)kmem_cache_alloc(pq_cache, GFP_KERNEL);
+
+    // Failure Check
+    if(pq == NULL){
+        printk(KERN_ALERT DEVICE_NAME ": [PID:%d] Memory Error in allocating priority queue!", current->pid);
+		return NULL;
     }
+    init_queue_header(pq);
+    return pq;
 }
 
-// pq helper function 2 : rearranges nodes to maintain priority order in the priority queue
-static void heapify_top_bottom(priority_queue *pq, int32_t parent_index){
-    int32_t left_child = parent_index * 2 + 1;
-    int32_t right_child = parent_index * 2 + 2;
-    int32_t smallest=parent_index;
+// pq header init function : makes pq an empty priority queue, used for the queue embedded in a pq_file too
+static void init_queue_header(priority_queue *pq){
+    mutex_init(&pq->lock);
+    init_waitqueue_head(&pq->wait);
+    pq->ops = &heap_ops;
+    pq->mode = PB2_MODE_HEAP;
+    pq->keys = NULL;
+    pq->items = NULL;
+    pq->key_mem = NULL;
+    pq->alloc = 0;
+    pq->capacity = 0;
+    pq->count = 0;
+    pq->timer = 0;
+    pq->input_state = 1;
+    pq->pending_value = 0;
+    pq->slots = NULL;
+    pq->slot_alloc = 0;
+    pq->slot_used = 0;
+    pq->free_slot = -1;
+    pq->handle_seq = 0;
+    pq->buckets = NULL;
+    pq->bucket_bits = NULL;
+    pq->bucket_summary = NULL;
+    pq->levels = 0;
+    pq->nodes = NULL;
+    pq->node_alloc = 0;
+    pq->node_used = 0;
+    pq->free_node = -1;
+    pq->radix_last = 0;
+    pq->shards = NULL;
+    pq->shard_mem = NULL;
+    pq->nr_shards = 0;
+    pq->skip_head = NULL;
+    mutex_init(&pq->skip_lock);
+    atomic_set(&pq->skip_count, 0);
+    init_llist_head(&pq->combine);
+    pq->name[0] = '\0';
+    pq->top = NULL;
+}
 
-    if(left_child < pq->count){
-        if( (pq->arr[smallest].priority > pq->arr[left_child].priority) 
-            ||
-            (
-                (pq->arr[left_child].priority == pq->arr[smallest].priority)
-                &&
-                (pq->arr[smallest].in_time > pq->arr[left_child].in_time)
-            )
-        ){
-            smallest = left_child;
-        }
+// pq configure function : empties the priority queue, sets its capacity and switches it to the given mode
+/** @note the new backend is set up before the old one is released, a failure leaves the queue untouched
+ * @note : caller must hold pq->lock
+ */
+static int32_t configure_priority_queue(priority_queue *pq, int32_t capacity, int32_t mode, int32_t param){
+    const pq_ops *ops;
+    int32_t ret;
+
+    if(mode < 0 || mode >= ARRAY_SIZE(pq_modes)){
+        return -EINVAL;
     }
+    ops = pq_modes[mode];
+    ret = ops->setup(pq, capacity, param);
+    if(ret < 0){
+        return ret;
+    }
+
+    /* read without the lock by pq_is_concurrent */
+    WRITE_ONCE(pq->ops, ops);
+    pq->mode = mode;
+    pq->capacity = capacity;
+    pq->count = 0;
+    /* the handles of the dropped elements die with the table, handle_seq keeps new ones distinct;
+     * a heap keeps a table that still fits its capacity, find_handle ignores the slots past slot_used */
+    if(ops != &heap_ops || pq->slot_alloc > capacity){
+        kvfree(pq->slots);
+        pq->slots = NULL;
+        pq->slot_alloc = 0;
+    }
+    pq->slot_used = 0;
+    pq->free_slot = -1;
+    pq->timer = 0;
+    pq->input_state = 1;
+    return 0;
+}
+
+// rcu callback of destroy_priority_queue : returns the header to pq_cache
+static void free_priority_queue_rcu(struct rcu_head *head){
+    kmem_cache_free(pq_cache, container_of(head, priority_queue, rcu));
+}
+
+// pq destroy function : deletes all nodes, and frees the priority queue
+/** @note an epoll set may still watch the wait queue of a shared queue the file has detached from,
+ * wake_up_pollfree() unhooks it and the header is only freed after an RCU grace period
+ */
+static priority_queue* destroy_priority_queue(priority_queue* pq){
+    if(pq == NULL){
+        return pq;
+    }
+    release_priority_queue(pq);
+    call_rcu(&pq->rcu, free_priority_queue_rcu);
+    return NULL;
+}
+
+// pq release function : frees everything the priority queue owns but its header
+static void release_priority_queue(priority_queue *pq){
+    wake_up_pollfree(&pq->wait);
+    mutex_destroy(&pq->lock);
+    mutex_destroy(&pq->skip_lock);
+    pq->ops->release(pq);
+    kvfree(pq->slots);
+    /* the mappings hold their own reference on the page, it outlives the queue until they are gone */
+    if(pq->top != NULL){
+        free_page((unsigned long)pq->top);
+    }
+}
+
+// pq state check : a queue is usable once PB2_SET_CAPACITY (or the capacity write) has sized it
+static inline int32_t pq_is_ready(priority_queue *pq){
+    return pq->capacity > 0;
+}
+
+// pq mode check : whether the backend takes its own locks; such a queue is shared, so it keeps its mode
+// and may be checked without the lock
+static inline int32_t pq_is_concurrent(priority_queue *pq){
+    return READ_ONCE(pq->ops)->try_pop != NULL;
+}
+
+// pq size accessor : number of queued elements, a hint unless pq->lock is held (and the backend is not concurrent)
+static inline int32_t queue_count(priority_queue *pq){
+    return pq_is_concurrent(pq) ? pq->ops->count(pq) : READ_ONCE(pq->count);
+}
+
+// heap setup function : allocates the arrays of an empty heap
+/** @note only PQ_MIN_ALLOC slots are allocated up front, the array grows geometrically
+ * on insert up to the capacity and is shrunk again once the queue drains
+ * @note a heap that is reconfigured keeps its arrays when they are no smaller than fresh ones and still
+ * fit the new capacity, so PB2_SET_CAPACITY on a heap usually allocates nothing; grown arrays shrink on the next pops
+ */
+static int32_t heap_setup(priority_queue *pq, int32_t capacity, int32_t param){
+    int32_t alloc = min(capacity, PQ_MIN_ALLOC);
+    void *key_mem;
+    uint64_t *keys;
+    pq_item *items;
+
+    if(pq->ops == &heap_ops && pq->keys != NULL && pq->alloc >= alloc && pq->alloc <= capacity){
+        return 0;
+    }
+    keys = alloc_keys(alloc, &key_mem);
+    items = (pq_item *)kvmalloc_array(alloc, sizeof(pq_item), GFP_KERNEL);
+
+    //check if allocation succeed
+	if (keys == NULL || items == NULL) {
+		printk(KERN_ALERT DEVICE_NAME ": [PID:%d] Memory Error while allocating priority queue->keys!", current->pid);
+        kvfree(key_mem);
+        kvfree(items);
+		return -ENOMEM;
+	}
+
+    pq->ops->release(pq);
+    pq->keys = keys;
+    pq->items = items;
+    pq->key_mem = key_mem;
+    pq->alloc = alloc;
+    return 0;
+}
+
+static void heap_release(priority_queue *pq){
+    pq_log(KERN_INFO DEVICE_NAME ": [PID:%d], %ld bytes of priority_queue->keys/items Space freed.\n", current->pid, pq->alloc * (sizeof(uint64_t) + sizeof(pq_item)));
+	kvfree(pq->key_mem);
+    kvfree(pq->items);
+    pq->keys = NULL;
+    pq->items = NULL;
+    pq->key_mem = NULL;
+    pq->alloc = 0;
+}
+
+// pq resize function : moves the elements to freshly allocated arrays of the given number of slots
+static int32_t resize_priority_queue(priority_queue *pq, int32_t alloc){
+    void *key_mem;
+    uint64_t *keys = alloc_keys(alloc, &key_mem);
+    pq_item *items = (pq_item *)kvmalloc_array(alloc, sizeof(pq_item), GFP_KERNEL);
+
+    if(keys == NULL || items == NULL){
+        kvfree(key_mem);
+        kvfree(items);
+        return -ENOMEM;
+    }
+    memcpy(keys, pq->keys, pq->count * sizeof(uint64_t));
+    memcpy(items, pq->items, pq->count * sizeof(pq_item));
+    kvfree(pq->key_mem);
+    kvfree(pq->items);
+    pq->keys = keys;
+    pq->items = items;
+    pq->key_mem = key_mem;
+    pq->alloc = alloc;
+    return 0;
+}
+
+// pq capacity bound : max_capacity, clamped to what the element arrays can be allocated for
+static inline int32_t capacity_limit(void){
+    return min(READ_ONCE(max_capacity), PQ_CAPACITY_LIMIT);
+}
+
+// pq capacity check : capacities are accepted in [1, capacity_limit()]
+static int32_t valid_capacity(int32_t capacity){
+    return capacity > 0 && capacity <= capacity_limit();
+}
+
+// pq insert function : insert given value in the priority_queue
+/** @note we maintain a state variable in the priority queue struct that 
+ * keeps track whether the input value is a number 
+ * or priority since both will be given by the user 
+ * process via identical write() calls
+ */
+static int32_t push_value(priority_queue *pq, int32_t num) {
+    int32_t ret;
+
+    if(queue_count(pq) >= pq->capacity){
+        return -EACCES;
+    }
+
+    if(pq->input_state == 1){
+        pq->pending_value = num;
+        pq->input_state = 2;
+    }else{
+        ret = push_element(pq, pq->pending_value, num);
+        if(ret < 0){
+            return ret;
+        }
+        pq->input_state = 1;
+    }
+
+    return 0;
+}
+
+// pq insert function : inserts a complete (value, priority) pair in the priority_queue
+// @return : >= 0 (in PB2_MODE_HEAP the slot of the element, see handle_of), or a negative errno
+static int32_t push_element(priority_queue *pq, int32_t value, int32_t priority) {
+    if(pq->count >= pq->capacity){
+        return -EACCES;
+    }
+    if(priority < 0){
+        return -EINVAL;
+    }
+    return pq->ops->push(pq, value, priority);
+}
+
+// heap insert function : the push of PB2_MODE_HEAP
+// @return : slot of the element (see handle_of), or a negative errno
+static int32_t heap_push(priority_queue *pq, int32_t value, int32_t priority) {
+    int32_t slot;
+
+    /* grow geometrically, bounded by the capacity */
+    if(pq->count == pq->alloc && resize_priority_queue(pq, min(pq->capacity, 2 * pq->alloc)) < 0){
+        return -ENOMEM;
+    }
+    slot = alloc_slot(pq);
+    if(slot < 0){
+        return slot;
+    }
+    pq->keys[pq->count] = make_key(priority, pq->timer);
+    pq->items[pq->count].value = value;
+    pq->items[pq->count].slot = slot;
+    pq->slots[slot].index = pq->count;
+    heapify_bottom_top(pq, pq->count);
+    pq->count += 1;
+    pq->timer += 1;
+    return slot;
+}
+
+// handle table growth : makes room for at least need slots, growing geometrically up to the capacity
+static int32_t grow_slots(priority_queue *pq, int32_t need){
+    pq_slot *slots;
+    int32_t alloc;
+
+    if(need <= pq->slot_alloc){
+        return 0;
+    }
+    alloc = min(pq->capacity, max3(need, 2 * pq->slot_alloc, PQ_MIN_ALLOC));
+    slots = (pq_slot *)kvmalloc_array(alloc, sizeof(pq_slot), GFP_KERNEL);
+    if(slots == NULL){
+        return -ENOMEM;
+    }
+    if(pq->slots != NULL){
+        memcpy(slots, pq->slots, pq->slot_used * sizeof(pq_slot));
+    }
+    kvfree(pq->slots);
+    pq->slots = slots;
+    pq->slot_alloc = alloc;
+    return 0;
+}
+
+// handle slot allocator : reuses a freed slot or hands out a new one, growing the table up to the capacity
+static int32_t alloc_slot(priority_queue *pq){
+    int32_t slot;
+
+    if(pq->free_slot >= 0){
+        slot = pq->free_slot;
+        pq->free_slot = pq->slots[slot].index;
+    }else{
+        if(grow_slots(pq, pq->slot_used + 1) < 0){
+            return -ENOMEM;
+        }
+        slot = pq->slot_used++;
+    }
+    pq->slots[slot].gen = pq->handle_seq++;
+    return slot;
+}
+
+static inline void free_slot(priority_queue *pq, int32_t slot){
+    pq->slots[slot].index = pq->free_slot;
+    pq->free_slot = slot;
+}
+
+static inline uint64_t handle_of(priority_queue *pq, int32_t slot){
+    return ((uint64_t)pq->slots[slot].gen << 32) | (uint32_t)slot;
+}
+
+// handle lookup : position in the heap of the element named by handle, -ENOENT once it has left the queue
+/** @note a freed slot keeps its generation but chains to another slot through index, and the element
+ * there belongs to a different slot, so the last check rejects it
+ */
+static int32_t find_handle(priority_queue *pq, uint64_t handle){
+    uint32_t slot = (uint32_t)handle;
+    int32_t index;
+
+    if(slot >= pq->slot_used || pq->slots[slot].gen != (uint32_t)(handle >> 32)){
+        return -ENOENT;
+    }
+    index = pq->slots[slot].index;
+    if(index < 0 || index >= pq->count || pq->items[index].slot != slot){
+        return -ENOENT;
+    }
+    return index;
+}
+
+// pq batch insert function : inserts records in order until one of them fails
+// @return : number of records inserted, or the error of the first record if none was
+static int32_t push_records(priority_queue *pq, const pq_record *recs, int32_t n) {
+    int32_t i;
+    int32_t ret = 0;
+
+    for(i = 0; i < n; i++){
+        ret = push_element(pq, recs[i].value, recs[i].priority);
+        if(ret < 0){
+            break;
+        }
+    }
+    return (i == 0 && ret < 0) ? ret : i;
+}
+
+// pq bulk load function : appends bulk->count records and restores the heap order in one pass
+/** @note all or nothing : the records are staged past pq->count and only become part of the queue once all
+ * of them were copied and checked. When they are at least as many as the queued elements the whole heap is
+ * rebuilt bottom-up (Floyd), trickling down every internal node from the last one, which is O(n);
+ * a smaller load is cheaper to bubble up one element at a time.
+ * @note : caller holds pq->lock
+ * @return : number of records loaded, or a negative errno
+ */
+static int32_t bulk_load(priority_queue *pq, const pb2_bulk *bulk){
+    if(bulk->count < 0){
+        return -EINVAL;
+    }
+    if(bulk->count > pq->capacity - pq->count){
+        return -EACCES;
+    }
+    if(bulk->count == 0){
+        return 0;
+    }
+    return pq->ops->bulk_load(pq, bulk);
+}
+
+// heap reserve function : grows the arrays and the handle table so that n more pushes cannot fail
+static int32_t heap_reserve(priority_queue *pq, int32_t n){
+    if(pq->count + n > pq->alloc &&
+       resize_priority_queue(pq, min(pq->capacity, max(pq->count + n, 2 * pq->alloc))) < 0){
+        return -ENOMEM;
+    }
+    return grow_slots(pq, min(pq->capacity, pq->slot_used + n));
+}
+
+// heap bulk load function : the bulk_load of PB2_MODE_HEAP, records are copied straight into the heap arrays
+static int32_t heap_bulk_load(priority_queue *pq, const pb2_bulk *bulk){
+    const pq_record __user *urecs = u64_to_user_ptr(bulk->records);
+    pq_record recs[PQ_BATCH_CHUNK];
+    int32_t old_count = pq->count;
+    int32_t done, n, i, slot;
+
+    /* make room for everything first so nothing can fail once elements are linked in */
+    if(heap_reserve(pq, bulk->count) < 0){
+        return -ENOMEM;
+    }
+
+    for(done = 0; done < bulk->count; done += n){
+        n = min(bulk->count - done, PQ_BATCH_CHUNK);
+        if(copy_from_user(recs, urecs + done, n * sizeof(pq_record))){
+            return -EFAULT;
+        }
+        for(i = 0; i < n; i++){
+            if(recs[i].priority < 0){
+                return -EINVAL;
+            }
+            pq->keys[old_count + done + i] = make_key(recs[i].priority, pq->timer + done + i);
+            pq->items[old_count + done + i].value = recs[i].value;
+        }
+    }
+
+    for(i = old_count; i < old_count + bulk->count; i++){
+        slot = alloc_slot(pq);
+        pq->items[i].slot = slot;
+        pq->slots[slot].index = i;
+    }
+    pq->count += bulk->count;
+    pq->timer += bulk->count;
+
+    if(bulk->count >= old_count){
+        for(i = heap_parent(pq->count - 1); i >= 0; i--){
+            heapify_top_bottom(pq, i);
+        }
+    }else{
+        for(i = old_count; i < pq->count; i++){
+            heapify_bottom_top(pq, i);
+        }
+    }
+    return bulk->count;
+}
+
+// pq shrink function : halves the array once the queue has drained below a quarter of it
+// @note : a failed allocation simply keeps the larger array
+static void shrink_priority_queue(priority_queue *pq){
+    if(pq->alloc > PQ_MIN_ALLOC && pq->count < pq->alloc / 4){
+        resize_priority_queue(pq, max(pq->alloc / 2, PQ_MIN_ALLOC));
+    }
+}
+
+// pq max lookup : index of the max element, one of the children of the root (the first max level)
+static int32_t max_index(priority_queue *pq){
+    int32_t best = 0;
+    int32_t i;
+
+    for(i = 1; i <= PQ_ARITY && i < pq->count; i++){
+        if(pq->keys[i] > pq->keys[best]){
+            best = i;
+        }
+    }
+    return best;
+}
+
+// pq repair function : restores the min-max order after the element at index was replaced or changed priority
+/** @note an element on the wrong side of its parent swaps with it : the parent then sits above a subtree it
+ * bounds the wrong way and trickles down, while the element climbs the parent's kind of levels. Otherwise
+ * the element either climbs its own kind of levels or, if it stayed put, trickles down.
+ */
+static void repair_index(priority_queue *pq, int32_t index){
+    int32_t parent = heap_parent(index);
+    int32_t slot = pq->items[index].slot;
+
+    if(index > 0 && heap_before(pq, index, parent, is_min_level(index))){
+        heap_swap(pq, index, parent);
+        heapify_top_bottom(pq, index);
+        heapify_bottom_top(pq, parent);
+        return;
+    }
+    heapify_bottom_top(pq, index);
+    if(pq->slots[slot].index == index){
+        heapify_top_bottom(pq, index);
+    }
+}
+
+// pq remove function : removes the element at index and stores it in out
+/** @note bottom-up removal (Floyd) : every element is the min (or max) of its subtree, so the best of its
+ * descendants can move into the hole it leaves, down to a leaf, without comparing against the last
+ * element; the last element then fills the leaf and only climbs back up, usually by a level or none
+ */
+static void pop_index(priority_queue *pq, int32_t index, data *out){
+    int32_t is_max = !is_min_level(index);
+    int32_t hole = index;
+    int32_t best;
+
+    read_element(pq, index, out);
+    free_slot(pq, out->slot);
+
+    while((best = best_descendant(pq, hole, is_max)) >= 0){
+        heap_move(pq, best, hole);
+        hole = best;
+    }
+
+    pq->count -= 1;
+    if(hole < pq->count){
+        heap_move(pq, pq->count, hole);
+        heapify_bottom_top(pq, hole);
+    }
+    shrink_priority_queue(pq);
+}
+
+// pq pop function : removes the min (is_max = 0) or the max (is_max = 1) element and stores it in out
+// @note : caller checks that the queue is not empty
+static void pop_element(priority_queue *pq, int32_t is_max, data *out){
+    pq->ops->pop(pq, is_max, out);
+}
+
+// pq peek function : stores the min (is_max = 0) or the max (is_max = 1) element in out
+// @note : caller checks that the queue is not empty
+static void peek_element(priority_queue *pq, int32_t is_max, data *out){
+    pq->ops->peek(pq, is_max, out);
+}
+
+static void heap_pop(priority_queue *pq, int32_t is_max, data *out){
+    pop_index(pq, is_max ? max_index(pq) : 0, out);
+}
+
+static void heap_peek(priority_queue *pq, int32_t is_max, data *out){
+    read_element(pq, is_max ? max_index(pq) : 0, out);
+}
+
+// pq delete function : remvoes the top element of the priority_queue
+static int32_t pop_value(priority_queue *pq){
+    data d;
+
+    if(pq->count == 0){
+        return -INF;
+    }
+
+    pop_element(pq, 0, &d);
+    return d.value;
+}
+
+// pq batch delete function : pops up to n elements in priority order into out
+// @return : number of elements popped
+static int32_t pop_values(priority_queue *pq, int32_t *out, int32_t n){
+    int32_t i;
+
+    for(i = 0; i < n && pq->count > 0; i++){
+        out[i] = pop_value(pq);
+    }
+    return i;
+}
+
+// pq delete max function : remvoes the max element of the priority_queue
+static int32_t pop_max_value(priority_queue *pq){
+    data d;
+
+    if(pq->count == 0){
+        return -INF;
+    }
+
+    pop_element(pq, 1, &d);
+    return d.value;
+}
+
+// pq wake function : wakes the readers and pollers of the queue after elements were inserted or popped
+// @note : the lockless check pairs with the barrier in the waiters' prepare_to_wait()
+static void wake_priority_queue(priority_queue *pq){
+    if(wq_has_sleeper(&pq->wait)){
+        wake_up_interruptible(&pq->wait);
+    }
+}
+
+// top page update function : republishes count, capacity, min and max in the pb2_top page of the queue
+// @note : caller holds pq->lock, a no-op until the page has been mapped
+static void update_top_page(priority_queue *pq){
+    pb2_top *top = pq->top;
+    data min, max;
+    int32_t found;
+
+    if(top == NULL){
+        return;
+    }
+
+    WRITE_ONCE(top->seq, top->seq + 1);
+    smp_wmb();
+    WRITE_ONCE(top->count, queue_count(pq));
+    WRITE_ONCE(top->capacity, pq->capacity);
+    if(pq_is_concurrent(pq)){
+        found = pq->ops->try_peek(pq, 0, &min) == 0 && pq->ops->try_peek(pq, 1, &max) == 0;
+    }else if((found = pq->count > 0)){
+        peek_element(pq, 0, &min);
+        peek_element(pq, 1, &max);
+    }
+    if(found){
+        WRITE_ONCE(top->min_value, min.value);
+        WRITE_ONCE(top->min_priority, min.priority);
+        WRITE_ONCE(top->max_value, max.value);
+        WRITE_ONCE(top->max_priority, max.priority);
+    }
+    smp_wmb();
+    WRITE_ONCE(top->seq, top->seq + 1);
+}
+
+// top page refresh function : update_top_page for the paths that run without pq->lock (concurrent backends)
+// @note : a no-op until the page is mapped, after that every operation of a multi queue takes pq->lock once more
+static void refresh_top_page(priority_queue *pq){
+    if(READ_ONCE(pq->top) == NULL){
+        return;
+    }
+    mutex_lock(&pq->lock);
+    update_top_page(pq);
+    mutex_unlock(&pq->lock);
+}
+
+// top page map function : returns the pb2_top page of the queue, allocating and filling it on first use
+static pb2_top* map_top_page(priority_queue *pq){
+    pb2_top *top;
+
+    mutex_lock(&pq->lock);
+    if(pq->top == NULL){
+        top = (pb2_top *)get_zeroed_page(GFP_KERNEL);
+        if(top == NULL){
+            mutex_unlock(&pq->lock);
+            return NULL;
+        }
+        pq->top = top;
+        update_top_page(pq);
+    }
+    top = pq->top;
+    mutex_unlock(&pq->lock);
+    return top;
+}
+
+// pq wait function : sleeps until pq, the queue entry's file has pinned, holds an element, for at most *timeout jiffies
+/** @note : caller holds pq->lock, it is dropped while sleeping and held again on return; *timeout is left with
+ * what remains of it
+ * @note : switch_entry_queue wakes the sleepers of the queue a file leaves, the wait ends once the file of
+ * entry uses another queue
+ * @return : 0 once the queue is not empty, -EAGAIN if timeout is 0, -ETIMEDOUT once it expired,
+ * -ERESTARTSYS if a signal arrived, PQ_SWITCHED if the file was switched to another queue
+ */
+static long wait_for_element(hashtable *entry, priority_queue *pq, long *timeout){
+    long ret;
+
+    while(pq->count == 0){
+        if(READ_ONCE(entry->pq) != pq){
+            return PQ_SWITCHED;
+        }
+        if(*timeout == 0){
+            return -EAGAIN;
+        }
+        mutex_unlock(&pq->lock);
+        ret = wait_event_interruptible_timeout(pq->wait, READ_ONCE(pq->count) > 0 || READ_ONCE(entry->pq) != pq, *timeout);
+        mutex_lock(&pq->lock);
+        if(ret < 0){
+            return ret;
+        }
+        if(ret == 0){
+            *timeout = 0;
+            return pq->count > 0 ? 0 : -ETIMEDOUT;
+        }
+        /* another reader may have taken the element, wait again for what is left of the timeout */
+        *timeout = ret;
+    }
+    return 0;
+}
+
+// concurrent wait function : pops the min or the max of a concurrent queue the file of entry has pinned, sleeping
+// for at most *timeout jiffies while it is empty
+// @return : like wait_for_element, or the error of try_pop
+static long concurrent_wait_pop(hashtable *entry, priority_queue *pq, int32_t is_max, long *timeout, data *out){
+    long ret;
+
+    while((ret = pq->ops->try_pop(pq, is_max, out)) == -EAGAIN){
+        if(READ_ONCE(entry->pq) != pq){
+            return PQ_SWITCHED;
+        }
+        if(*timeout == 0){
+            return -EAGAIN;
+        }
+        ret = wait_event_interruptible_timeout(pq->wait, pq->ops->count(pq) > 0 || READ_ONCE(entry->pq) != pq, *timeout);
+        if(ret < 0){
+            return ret;
+        }
+        if(ret == 0){
+            *timeout = 0;
+            return pq->ops->try_pop(pq, is_max, out) == 0 ? 0 : -ETIMEDOUT;
+        }
+        *timeout = ret;
+    }
+    return ret;
+}
+
+// concurrent read function : pops up to n values into out, sleeping for at most *timeout jiffies for the first one
+// @note : every value is popped on its own, in PB2_MODE_MULTI they are only ordered up to the rank error
+// @return : number of values popped, or the error of concurrent_wait_pop
+static int32_t concurrent_pop_values(hashtable *entry, priority_queue *pq, int32_t *out, int32_t n, long *timeout){
+    data d;
+    long ret = concurrent_wait_pop(entry, pq, 0, timeout, &d);
+    int32_t i;
+
+    if(ret < 0){
+        return ret;
+    }
+    out[0] = d.value;
+    for(i = 1; i < n && pq->ops->try_pop(pq, 0, &d) == 0; i++){
+        out[i] = d.value;
+    }
+    return i;
+}
+
+/** top-k helpers : a small binary min heap of indexes into the heap, ordered like the elements they point to
+ * @note the smallest element not yet reported is always one of the candidates : every element is at least
+ * its parent if that is a min level, or its grandparent otherwise, and the children and grandchildren of a
+ * min level node become candidates when it is reported; a max level node is larger than its children,
+ * which are already candidates as grandchildren of its parent, so reporting it adds nothing
+ */
+static void cand_push(priority_queue *pq, int32_t *cand, int32_t *size, int32_t index){
+    int32_t i = (*size)++;
+
+    while(i > 0 && pq->keys[index] < pq->keys[cand[(i - 1) / 2]]){
+        cand[i] = cand[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    cand[i] = index;
+}
+
+static int32_t cand_pop(priority_queue *pq, int32_t *cand, int32_t *size){
+    int32_t top = cand[0];
+    int32_t last = cand[--(*size)];
+    int32_t i = 0, child;
+
+    while((child = 2 * i + 1) < *size){
+        if(child + 1 < *size && pq->keys[cand[child + 1]] < pq->keys[cand[child]]){
+            child++;
+        }
+        if(pq->keys[cand[child]] >= pq->keys[last]){
+            break;
+        }
+        cand[i] = cand[child];
+        i = child;
+    }
+    cand[i] = last;
+    return top;
+}
+
+// top-k helper : bound on the candidates peek_top_k holds at once, at most one per element of the heap
+static inline size_t top_k_candidates(priority_queue *pq, int32_t k){
+    return min_t(size_t, (PQ_FANOUT - 1) * (size_t)k + 1, pq->count);
+}
+
+// pq top-k function : copies the k smallest elements to out in priority order without touching the heap
+/** @note : caller holds pq->lock, k <= pq->count; cand needs room for top_k_candidates(pq, k) indexes : each
+ * reported node adds at most PQ_FANOUT candidates, and only a min level node adds any, so no index is added twice
+ * @return : number of elements copied
+ */
+static int32_t peek_top_k(priority_queue *pq, pq_record *out, int32_t *cand, int32_t k){
+    int32_t size = 0;
+    int32_t n, i, index, first;
+
+    if(k == 0){
+        return 0;
+    }
+    cand_push(pq, cand, &size, 0);
+    for(n = 0; n < k; n++){
+        index = cand_pop(pq, cand, &size);
+        out[n].value = pq->items[index].value;
+        out[n].priority = pq->keys[index] >> 32;
+        if(!is_min_level(index)){
+            continue;
+        }
+        first = heap_child(index);
+        for(i = first; i < first + PQ_ARITY && i < pq->count; i++){
+            cand_push(pq, cand, &size, i);
+        }
+        /* the grandchildren sit next to each other */
+        first = heap_child(first);
+        for(i = first; i < first + PQ_ARITY * PQ_ARITY && i < pq->count; i++){
+            cand_push(pq, cand, &size, i);
+        }
+    }
+    return n;
+}
+
+/** bucket mode : a FIFO of nodes per priority, a bitmap of the non-empty buckets and a summary bitmap of its
+ * non-zero words, so the smallest or largest queued priority is found with two word scans
+ * @note the FIFO order stands in for in_time : pop-min takes the oldest element of the smallest priority
+ * and pop-max the newest of the largest, like the heap does
+ */
+static int32_t bucket_setup(priority_queue *pq, int32_t capacity, int32_t levels){
+    int32_t alloc = min(capacity, PQ_MIN_ALLOC);
+    pq_bucket *buckets;
+    unsigned long *bits, *summary;
+    pq_node *nodes;
+    int32_t i;
+
+    if(levels <= 0 || levels > PQ_BUCKET_MAX_LEVELS){
+        return -EINVAL;
+    }
+    buckets = (pq_bucket *)kvmalloc_array(levels, sizeof(pq_bucket), GFP_KERNEL);
+    bits = kvcalloc(BITS_TO_LONGS(levels), sizeof(unsigned long), GFP_KERNEL);
+    summary = kcalloc(BITS_TO_LONGS(BITS_TO_LONGS(levels)), sizeof(unsigned long), GFP_KERNEL);
+    nodes = (pq_node *)kvmalloc_array(alloc, sizeof(pq_node), GFP_KERNEL);
+    if(buckets == NULL || bits == NULL || summary == NULL || nodes == NULL){
+        printk(KERN_ALERT DEVICE_NAME ": [PID:%d] Memory Error while allocating priority queue->buckets!", current->pid);
+        kvfree(buckets);
+        kvfree(bits);
+        kfree(summary);
+        kvfree(nodes);
+        return -ENOMEM;
+    }
+    for(i = 0; i < levels; i++){
+        buckets[i].head = -1;
+        buckets[i].tail = -1;
+    }
+
+    pq->ops->release(pq);
+    pq->buckets = buckets;
+    pq->bucket_bits = bits;
+    pq->bucket_summary = summary;
+    pq->levels = levels;
+    pq->nodes = nodes;
+    pq->node_alloc = alloc;
+    pq->node_used = 0;
+    pq->free_node = -1;
+    return 0;
+}
+
+static void bucket_release(priority_queue *pq){
+    kvfree(pq->buckets);
+    kvfree(pq->bucket_bits);
+    kfree(pq->bucket_summary);
+    kvfree(pq->nodes);
+    pq->buckets = NULL;
+    pq->bucket_bits = NULL;
+    pq->bucket_summary = NULL;
+    pq->levels = 0;
+    pq->nodes = NULL;
+    pq->node_alloc = 0;
+    pq->node_used = 0;
+    pq->free_node = -1;
+}
+
+// bucket node growth : makes room for at least need nodes, growing geometrically up to the capacity
+static int32_t grow_nodes(priority_queue *pq, int32_t need){
+    pq_node *nodes;
+    int32_t alloc;
+
+    if(need <= pq->node_alloc){
+        return 0;
+    }
+    alloc = min(pq->capacity, max(need, 2 * pq->node_alloc));
+    nodes = (pq_node *)kvmalloc_array(alloc, sizeof(pq_node), GFP_KERNEL);
+    if(nodes == NULL){
+        return -ENOMEM;
+    }
+    memcpy(nodes, pq->nodes, pq->node_used * sizeof(pq_node));
+    kvfree(pq->nodes);
+    pq->nodes = nodes;
+    pq->node_alloc = alloc;
+    return 0;
+}
+
+// smallest / largest priority with a non-empty bucket, the queue must not be empty
+static inline int32_t bucket_first(priority_queue *pq){
+    unsigned long w = find_first_bit(pq->bucket_summary, BITS_TO_LONGS(pq->levels));
+
+    return w * BITS_PER_LONG + __ffs(pq->bucket_bits[w]);
+}
+
+static inline int32_t bucket_last(priority_queue *pq){
+    unsigned long w = find_last_bit(pq->bucket_summary, BITS_TO_LONGS(pq->levels));
+
+    return w * BITS_PER_LONG + __fls(pq->bucket_bits[w]);
+}
+
+/** node helpers shared by the bucket and radix modes : nodes come from a free chain or the untouched
+ * end of the array, and sit in a doubly linked FIFO per bucket
+ */
+static int32_t take_node(priority_queue *pq){
+    int32_t node;
+
+    if(pq->free_node >= 0){
+        node = pq->free_node;
+        pq->free_node = pq->nodes[node].next;
+        return node;
+    }
+    if(grow_nodes(pq, pq->node_used + 1) < 0){
+        return -ENOMEM;
+    }
+    return pq->node_used++;
+}
+
+static inline void put_node(priority_queue *pq, int32_t node){
+    pq->nodes[node].next = pq->free_node;
+    pq->free_node = node;
+}
+
+static inline void fifo_append(priority_queue *pq, pq_bucket *b, int32_t node){
+    pq->nodes[node].prev = b->tail;
+    pq->nodes[node].next = -1;
+    if(b->head < 0){
+        b->head = node;
+    }else{
+        pq->nodes[b->tail].next = node;
+    }
+    b->tail = node;
+}
+
+static inline void fifo_unlink(priority_queue *pq, pq_bucket *b, int32_t node){
+    pq_node *n = &pq->nodes[node];
+
+    if(n->prev >= 0){
+        pq->nodes[n->prev].next = n->next;
+    }else{
+        b->head = n->next;
+    }
+    if(n->next >= 0){
+        pq->nodes[n->next].prev = n->prev;
+    }else{
+        b->tail = n->prev;
+    }
+}
+
+// the priorities accepted by a node based mode, besides the generic priority >= 0
+static int32_t bucket_check(priority_queue *pq, int32_t priority){
+    return priority < pq->levels ? 0 : -EINVAL;
+}
+
+static int32_t bucket_push(priority_queue *pq, int32_t value, int32_t priority){
+    int32_t node;
+
+    if(bucket_check(pq, priority) < 0){
+        return -EINVAL;
+    }
+    node = take_node(pq);
+    if(node < 0){
+        return node;
+    }
+    pq->nodes[node].value = value;
+    if(pq->buckets[priority].head < 0){
+        __set_bit(priority, pq->bucket_bits);
+        __set_bit(priority / BITS_PER_LONG, pq->bucket_summary);
+    }
+    fifo_append(pq, &pq->buckets[priority], node);
+    pq->count += 1;
+    pq->timer += 1;
+    return 0;
+}
+
+static void bucket_peek(priority_queue *pq, int32_t is_max, data *out){
+    int32_t priority = is_max ? bucket_last(pq) : bucket_first(pq);
+    pq_bucket *b = &pq->buckets[priority];
+
+    out->value = pq->nodes[is_max ? b->tail : b->head].value;
+    out->priority = priority;
+    out->in_time = 0;
+    out->slot = -1;
+}
+
+static void bucket_pop(priority_queue *pq, int32_t is_max, data *out){
+    int32_t priority = is_max ? bucket_last(pq) : bucket_first(pq);
+    pq_bucket *b = &pq->buckets[priority];
+    int32_t node = is_max ? b->tail : b->head;
+
+    out->value = pq->nodes[node].value;
+    out->priority = priority;
+    out->in_time = 0;
+    out->slot = -1;
+
+    fifo_unlink(pq, b, node);
+    if(b->head < 0){
+        __clear_bit(priority, pq->bucket_bits);
+        if(pq->bucket_bits[priority / BITS_PER_LONG] == 0){
+            __clear_bit(priority / BITS_PER_LONG, pq->bucket_summary);
+        }
+    }
+    put_node(pq, node);
+    pq->count -= 1;
+}
+
+// bucket top-k function : walks the buckets from the smallest priority, cand is not needed
+static int32_t bucket_top_k(priority_queue *pq, pq_record *out, int32_t *cand, int32_t k){
+    int32_t n = 0;
+    int32_t priority, node;
+
+    if(k == 0){
+        return 0;
+    }
+    for(priority = bucket_first(pq); n < k && priority < pq->levels;
+        priority = find_next_bit(pq->bucket_bits, pq->levels, priority + 1)){
+        for(node = pq->buckets[priority].head; node >= 0 && n < k; node = pq->nodes[node].next){
+            out[n].value = pq->nodes[node].value;
+            out[n].priority = priority;
+            n++;
+        }
+    }
+    return n;
+}
+
+// staged bulk load function : the records are copied in first so that a bad one is found before any is queued
+// @note : check returns 0 or the errno the mode's push would give for the priority
+static int32_t staged_bulk_load(priority_queue *pq, const pb2_bulk *bulk, int32_t (*check)(priority_queue *, int32_t)){
+    pq_record *recs = (pq_record *)kvmalloc_array(bulk->count, sizeof(pq_record), GFP_KERNEL);
+    int32_t ret = bulk->count;
+    int32_t i;
+
+    if(recs == NULL){
+        return -ENOMEM;
+    }
+    if(copy_from_user(recs, u64_to_user_ptr(bulk->records), bulk->count * sizeof(pq_record))){
+        ret = -EFAULT;
+    }
+    for(i = 0; ret > 0 && i < bulk->count; i++){
+        if(recs[i].priority < 0){
+            ret = -EINVAL;
+        }else if(check(pq, recs[i].priority) < 0){
+            ret = check(pq, recs[i].priority);
+        }
+    }
+    /* with a node for every record the pushes cannot fail */
+    if(ret > 0 && grow_nodes(pq, pq->count + bulk->count) < 0){
+        ret = -ENOMEM;
+    }
+    for(i = 0; ret > 0 && i < bulk->count; i++){
+        pq->ops->push(pq, recs[i].value, recs[i].priority);
+    }
+    kvfree(recs);
+    return ret;
+}
+
+static int32_t bucket_bulk_load(priority_queue *pq, const pb2_bulk *bulk){
+    return staged_bulk_load(pq, bulk, bucket_check);
+}
+
+/** radix mode : a radix heap over the priorities, for workloads that never insert below the last popped
+ * minimum (deadlines, virtual times). Bucket 0 holds the priorities equal to radix_last and bucket b those
+ * whose highest bit differing from it is b - 1, so every bucket holds larger priorities than the ones
+ * below it. A pop-min from an empty bucket 0 settles the lowest non-empty bucket : its minimum becomes
+ * radix_last and its nodes move down, each node moving at most once per bit, O(log C) amortized.
+ * @note FIFOs only ever receive nodes newer than theirs or, when settling, whole buckets in order into
+ * empty buckets, so equal priorities keep their insertion order like in_time does in the heap
+ * @note pop-max scans the highest non-empty bucket
+ */
+static int32_t radix_setup(priority_queue *pq, int32_t capacity, int32_t param){
+    int32_t alloc = min(capacity, PQ_MIN_ALLOC);
+    pq_bucket *buckets = (pq_bucket *)kvmalloc_array(PQ_RADIX_BUCKETS, sizeof(pq_bucket), GFP_KERNEL);
+    unsigned long *bits = kvcalloc(BITS_TO_LONGS(PQ_RADIX_BUCKETS), sizeof(unsigned long), GFP_KERNEL);
+    pq_node *nodes = (pq_node *)kvmalloc_array(alloc, sizeof(pq_node), GFP_KERNEL);
+    int32_t i;
+
+    if(buckets == NULL || bits == NULL || nodes == NULL){
+        printk(KERN_ALERT DEVICE_NAME ": [PID:%d] Memory Error while allocating priority queue->buckets!", current->pid);
+        kvfree(buckets);
+        kvfree(bits);
+        kvfree(nodes);
+        return -ENOMEM;
+    }
+    for(i = 0; i < PQ_RADIX_BUCKETS; i++){
+        buckets[i].head = -1;
+        buckets[i].tail = -1;
+    }
+
+    pq->ops->release(pq);
+    pq->buckets = buckets;
+    pq->bucket_bits = bits;
+    pq->levels = PQ_RADIX_BUCKETS;
+    pq->nodes = nodes;
+    pq->node_alloc = alloc;
+    pq->node_used = 0;
+    pq->free_node = -1;
+    pq->radix_last = 0;
+    return 0;
+}
+
+static inline int32_t radix_bucket(priority_queue *pq, int32_t priority){
+    return priority == pq->radix_last ? 0 : fls(priority ^ pq->radix_last);
+}
+
+static int32_t radix_check(priority_queue *pq, int32_t priority){
+    return priority >= pq->radix_last ? 0 : -ERANGE;
+}
+
+static void radix_add(priority_queue *pq, int32_t node){
+    int32_t b = radix_bucket(pq, pq->nodes[node].priority);
+
+    __set_bit(b, pq->bucket_bits);
+    fifo_append(pq, &pq->buckets[b], node);
+}
+
+static void radix_remove(priority_queue *pq, int32_t b, int32_t node, data *out){
+    out->value = pq->nodes[node].value;
+    out->priority = pq->nodes[node].priority;
+    out->in_time = 0;
+    out->slot = -1;
+
+    fifo_unlink(pq, &pq->buckets[b], node);
+    if(pq->buckets[b].head < 0){
+        __clear_bit(b, pq->bucket_bits);
+    }
+    put_node(pq, node);
+    pq->count -= 1;
+}
+
+static int32_t radix_push(priority_queue *pq, int32_t value, int32_t priority){
+    int32_t node;
+
+    if(radix_check(pq, priority) < 0){
+        return -ERANGE;
+    }
+    node = take_node(pq);
+    if(node < 0){
+        return node;
+    }
+    pq->nodes[node].value = value;
+    pq->nodes[node].priority = priority;
+    radix_add(pq, node);
+    pq->count += 1;
+    pq->timer += 1;
+    return 0;
+}
+
+// radix scan : oldest node of the smallest (is_max = 0) or newest of the largest (is_max = 1) priority in bucket b
+static int32_t radix_scan(priority_queue *pq, int32_t b, int32_t is_max){
+    int32_t best = pq->buckets[b].head;
+    int32_t node;
+
+    for(node = pq->nodes[best].next; node >= 0; node = pq->nodes[node].next){
+        if(is_max ? pq->nodes[node].priority >= pq->nodes[best].priority :
+                    pq->nodes[node].priority < pq->nodes[best].priority){
+            best = node;
+        }
+    }
+    return best;
+}
+
+// radix settle : refills the empty bucket 0 from the lowest non-empty bucket, the queue must not be empty
+static void radix_settle(priority_queue *pq){
+    int32_t b = find_first_bit(pq->bucket_bits, PQ_RADIX_BUCKETS);
+    int32_t node = pq->buckets[b].head;
+    int32_t next;
+
+    pq->radix_last = pq->nodes[radix_scan(pq, b, 0)].priority;
+    pq->buckets[b].head = -1;
+    pq->buckets[b].tail = -1;
+    __clear_bit(b, pq->bucket_bits);
+    for(; node >= 0; node = next){
+        next = pq->nodes[node].next;
+        radix_add(pq, node);
+    }
+}
+
+static void radix_peek(priority_queue *pq, int32_t is_max, data *out){
+    int32_t b = is_max ? find_last_bit(pq->bucket_bits, PQ_RADIX_BUCKETS) : find_first_bit(pq->bucket_bits, PQ_RADIX_BUCKETS);
+    int32_t node = b == 0 ? pq->buckets[0].head : radix_scan(pq, b, is_max);
+
+    /* bucket 0 holds a single priority, its newest node is the max */
+    if(b == 0 && is_max){
+        node = pq->buckets[0].tail;
+    }
+    out->value = pq->nodes[node].value;
+    out->priority = pq->nodes[node].priority;
+    out->in_time = 0;
+    out->slot = -1;
+}
+
+static void radix_pop(priority_queue *pq, int32_t is_max, data *out){
+    int32_t b;
+
+    if(is_max){
+        b = find_last_bit(pq->bucket_bits, PQ_RADIX_BUCKETS);
+        radix_remove(pq, b, b == 0 ? pq->buckets[0].tail : radix_scan(pq, b, 1), out);
+        return;
+    }
+    if(pq->buckets[0].head < 0){
+        radix_settle(pq);
+    }
+    radix_remove(pq, 0, pq->buckets[0].head, out);
+}
+
+static int cmp_u64(const void *a, const void *b){
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+// radix top-k function : buckets are ordered among themselves, each is sorted on (priority, FIFO position)
+// @return : number of elements copied, or -ENOMEM
+static int32_t radix_top_k(priority_queue *pq, pq_record *out, int32_t *cand, int32_t k){
+    uint64_t *order;
+    int32_t *at;
+    int32_t n = 0;
+    int32_t b, m, i, node;
+
+    if(k == 0){
+        return 0;
+    }
+    order = kvmalloc_array(pq->count, sizeof(uint64_t) + sizeof(int32_t), GFP_KERNEL);
+    if(order == NULL){
+        return -ENOMEM;
+    }
+    at = (int32_t *)(order + pq->count);
+
+    for(b = find_first_bit(pq->bucket_bits, PQ_RADIX_BUCKETS); n < k && b < PQ_RADIX_BUCKETS;
+        b = find_next_bit(pq->bucket_bits, PQ_RADIX_BUCKETS, b + 1)){
+        m = 0;
+        for(node = pq->buckets[b].head; node >= 0; node = pq->nodes[node].next){
+            order[m] = ((uint64_t)pq->nodes[node].priority << 32) | m;
+            at[m++] = node;
+        }
+        sort(order, m, sizeof(uint64_t), cmp_u64, NULL);
+        for(i = 0; i < m && n < k; i++, n++){
+            out[n].value = pq->nodes[at[(uint32_t)order[i]]].value;
+            out[n].priority = order[i] >> 32;
+        }
+    }
+    kvfree(order);
+    return n;
+}
+
+static int32_t radix_bulk_load(priority_queue *pq, const pb2_bulk *bulk){
+    return staged_bulk_load(pq, bulk, radix_check);
+}
+
+/** multi mode : a relaxed queue for shared queues that many threads push and pop at once (the MultiQueue of
+ * Rihani, Sanders and Dementiev). The elements are spread over nr_shards heaps, each behind its own lock : an
+ * insert goes to a random shard and a pop takes the better end of two random shards, so concurrent operations
+ * mostly lock different shards instead of queueing on one lock.
+ * @note rank error : with c shards and uniformly random inserts, the popped element is among the O(c) best
+ * in expectation and among the O(c log c) best with high probability (Alistarh et al., "The Power of Choice
+ * in Priority Scheduling", 2017). Equal priorities in different shards come out in any order. A single shard
+ * is exact, and so are peek and top-k, which look at every shard; callers that need exact pops at any
+ * contention keep to the other modes.
+ * @note the shard capacities add up to the capacity, an insert only fails once every shard is full
+ * @note a shard lock is taken alone, or after pq->lock by the operations that look at every shard; the shards
+ * have their own lockdep class for that
+ */
+static struct lock_class_key pq_shard_key;
+
+static int32_t multi_setup(priority_queue *pq, int32_t capacity, int32_t param){
+    pq_shard *shards;
+    void *shard_mem;
+    int32_t nr, i;
+
+    if(param < 0 || param > PQ_MULTI_MAX_SHARDS){
+        return -EINVAL;
+    }
+    /* every shard holds at least one element */
+    nr = min3(param ? param : 2 * (int32_t)num_online_cpus(), capacity, PQ_MULTI_MAX_SHARDS);
+    shard_mem = kvzalloc(nr * sizeof(pq_shard) + L1_CACHE_BYTES, GFP_KERNEL);
+    if(shard_mem == NULL){
+        return -ENOMEM;
+    }
+    shards = (pq_shard *)PTR_ALIGN(shard_mem, L1_CACHE_BYTES);
+    for(i = 0; i < nr; i++){
+        shards[i].pq = init_priority_queue();
+        /* nobody else can see the shard yet, so it is configured without its lock */
+        if(shards[i].pq == NULL || configure_priority_queue(shards[i].pq, capacity / nr + (i < capacity % nr), PB2_MODE_HEAP, 0) < 0){
+            printk(KERN_ALERT DEVICE_NAME ": [PID:%d] Memory Error while allocating priority queue->shards!", current->pid);
+            for(; i >= 0; i--){
+                destroy_priority_queue(shards[i].pq);
+            }
+            kvfree(shard_mem);
+            return -ENOMEM;
+        }
+        lockdep_set_class(&shards[i].pq->lock, &pq_shard_key);
+        shards[i].min_priority = -1;
+        shards[i].max_priority = -1;
+    }
+
+    pq->ops->release(pq);
+    pq->shards = shards;
+    pq->shard_mem = shard_mem;
+    pq->nr_shards = nr;
+    return 0;
+}
+
+static void multi_release(priority_queue *pq){
+    int32_t i;
+
+    for(i = 0; i < pq->nr_shards; i++){
+        destroy_priority_queue(pq->shards[i].pq);
+    }
+    kvfree(pq->shard_mem);
+    pq->shards = NULL;
+    pq->shard_mem = NULL;
+    pq->nr_shards = 0;
+}
+
+// shard publish function : republishes the hints of the shard, caller holds its lock
+static void shard_publish(pq_shard *s){
+    priority_queue *h = s->pq;
+
+    WRITE_ONCE(s->count, h->count);
+    WRITE_ONCE(s->min_priority, h->count > 0 ? (int32_t)(h->keys[0] >> 32) : -1);
+    WRITE_ONCE(s->max_priority, h->count > 0 ? (int32_t)(h->keys[max_index(h)] >> 32) : -1);
+}
+
+// shard hint : priority at the min or max end of the shard, -1 while it looks empty
+static inline int32_t shard_end(pq_shard *s, int32_t is_max){
+    return is_max ? READ_ONCE(s->max_priority) : READ_ONCE(s->min_priority);
+}
+
+// shard choice : the one of a and b whose end comes first by the hints, NULL if both look empty
+static pq_shard* shard_pick(pq_shard *a, pq_shard *b, int32_t is_max){
+    int32_t pa = shard_end(a, is_max);
+    int32_t pb = shard_end(b, is_max);
+
+    if(pa < 0 || pb < 0){
+        return pa >= 0 ? a : pb >= 0 ? b : NULL;
+    }
+    return (is_max ? pb > pa : pb < pa) ? b : a;
+}
+
+// @note : get_random_u32_below() replaced prandom_u32_max() in 6.2
+static inline pq_shard* random_shard(priority_queue *pq){
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 2, 0)
+    return &pq->shards[get_random_u32_below(pq->nr_shards)];
+#else
+    return &pq->shards[prandom_u32_max(pq->nr_shards)];
+#endif
+}
+
+// shard scan : the shard whose end comes first over all of them by the hints, NULL if all look empty
+static pq_shard* multi_best(priority_queue *pq, int32_t is_max){
+    pq_shard *best = NULL;
+    int32_t i;
+
+    for(i = 0; i < pq->nr_shards; i++){
+        best = shard_pick(best ? best : &pq->shards[i], &pq->shards[i], is_max);
+    }
+    return best;
+}
+
+// shard insert / pop helpers : caller holds the shard lock, -EACCES if full, -EAGAIN if empty
+static int32_t shard_push(pq_shard *s, int32_t value, int32_t priority){
+    int32_t ret = push_element(s->pq, value, priority);
+
+    if(ret < 0){
+        return ret;
+    }
+    shard_publish(s);
+    return 0;
+}
+
+static int32_t shard_pop(pq_shard *s, int32_t is_max, data *out){
+    if(s->pq->count == 0){
+        return -EAGAIN;
+    }
+    pop_element(s->pq, is_max, out);
+    shard_publish(s);
+    return 0;
+}
+
+// multi insert function : the push of PB2_MODE_MULTI, into a random shard with room
+// @note : takes the shard lock itself, pq->lock may or may not be held
+static int32_t multi_push(priority_queue *pq, int32_t value, int32_t priority){
+    pq_shard *s;
+    int32_t i, start, ret;
+
+    for(i = 0; i < PQ_MULTI_TRIES; i++){
+        s = random_shard(pq);
+        if(READ_ONCE(s->count) < s->pq->capacity && mutex_trylock(&s->pq->lock)){
+            ret = shard_push(s, value, priority);
+            mutex_unlock(&s->pq->lock);
+            if(ret != -EACCES){
+                return ret;
+            }
+        }
+    }
+    /* contended or nearly full : try every shard in turn, waiting for the locks */
+    start = random_shard(pq) - pq->shards;
+    for(i = 0; i < pq->nr_shards; i++){
+        s = &pq->shards[(start + i) % pq->nr_shards];
+        if(READ_ONCE(s->count) >= s->pq->capacity){
+            continue;
+        }
+        mutex_lock(&s->pq->lock);
+        ret = shard_push(s, value, priority);
+        mutex_unlock(&s->pq->lock);
+        if(ret != -EACCES){
+            return ret;
+        }
+    }
+    return -EACCES;
+}
+
+// multi pop function : pops the min or the max of the better of two random shards
+// @note : takes the shard lock itself, pq->lock may or may not be held
+// @return : 0, or -EAGAIN once every shard was found empty
+static int32_t multi_pop(priority_queue *pq, int32_t is_max, data *out){
+    pq_shard *s;
+    int32_t i, ret;
+
+    for(i = 0; i < PQ_MULTI_TRIES; i++){
+        s = shard_pick(random_shard(pq), random_shard(pq), is_max);
+        if(s != NULL && mutex_trylock(&s->pq->lock)){
+            ret = shard_pop(s, is_max, out);
+            mutex_unlock(&s->pq->lock);
+            if(ret == 0){
+                return 0;
+            }
+        }
+    }
+    /* the samples kept missing : take the best end over all shards, waiting for its lock */
+    while((s = multi_best(pq, is_max)) != NULL){
+        mutex_lock(&s->pq->lock);
+        ret = shard_pop(s, is_max, out);
+        mutex_unlock(&s->pq->lock);
+        if(ret == 0){
+            return 0;
+        }
+    }
+    return -EAGAIN;
+}
+
+// multi peek function : the min or the max over all shards, the queue is left untouched
+// @return : 0, or -EAGAIN if the queue is empty
+static int32_t multi_peek(priority_queue *pq, int32_t is_max, data *out){
+    pq_shard *s;
+
+    while((s = multi_best(pq, is_max)) != NULL){
+        mutex_lock(&s->pq->lock);
+        if(s->pq->count > 0){
+            peek_element(s->pq, is_max, out);
+            mutex_unlock(&s->pq->lock);
+            return 0;
+        }
+        mutex_unlock(&s->pq->lock);
+    }
+    return -EAGAIN;
+}
+
+static int32_t multi_count(priority_queue *pq){
+    int32_t count = 0;
+    int32_t i;
+
+    for(i = 0; i < pq->nr_shards; i++){
+        count += READ_ONCE(pq->shards[i].count);
+    }
+    return count;
+}
+
+// shard lock helpers : lock or unlock every shard, for the operations that need the queue to hold still
+// @note : caller holds pq->lock, the lock every shard lock nests in
+static void multi_lock_all(priority_queue *pq){
+    int32_t i;
+
+    for(i = 0; i < pq->nr_shards; i++){
+        mutex_lock_nest_lock(&pq->shards[i].pq->lock, &pq->lock);
+    }
+}
+
+static void multi_unlock_all(priority_queue *pq){
+    int32_t i;
+
+    for(i = 0; i < pq->nr_shards; i++){
+        mutex_unlock(&pq->shards[i].pq->lock);
+    }
+}
+
+// multi top-k function : the k smallest elements over all shards, in priority order
+/** @note every shard is locked, so the result is exact; each shard reports up to k elements with peek_top_k
+ * and they are merged by sorting (priority, position) keys, which keeps the order of a shard among its ties
+ * @note : caller holds pq->lock
+ * @return : number of elements copied to out, or -ENOMEM
+ */
+static int32_t multi_top_k(priority_queue *pq, pq_record *out, int32_t k){
+    pq_record *recs;
+    uint64_t *order;
+    int32_t *cand;
+    size_t cands = 0;
+    int32_t total = 0;
+    int32_t n = 0;
+    int32_t i;
+
+    if(k == 0){
+        return 0;
+    }
+    multi_lock_all(pq);
+    for(i = 0; i < pq->nr_shards; i++){
+        total += min(k, pq->shards[i].pq->count);
+        cands = max(cands, top_k_candidates(pq->shards[i].pq, k));
+    }
+    recs = kvmalloc_array(total, sizeof(pq_record) + sizeof(uint64_t), GFP_KERNEL);
+    cand = kvmalloc_array(cands, sizeof(int32_t), GFP_KERNEL);
+    if(recs == NULL || cand == NULL){
+        multi_unlock_all(pq);
+        kvfree(recs);
+        kvfree(cand);
+        return -ENOMEM;
+    }
+    for(i = 0; i < pq->nr_shards; i++){
+        n += peek_top_k(pq->shards[i].pq, recs + n, cand, min(k, pq->shards[i].pq->count));
+    }
+    multi_unlock_all(pq);
+
+    order = (uint64_t *)(recs + total);
+    for(i = 0; i < n; i++){
+        order[i] = ((uint64_t)recs[i].priority << 32) | i;
+    }
+    sort(order, n, sizeof(uint64_t), cmp_u64, NULL);
+    n = min(n, k);
+    for(i = 0; i < n; i++){
+        out[i] = recs[(uint32_t)order[i]];
+    }
+    kvfree(recs);
+    kvfree(cand);
+    return n;
+}
+
+// multi bulk load function : spreads the records evenly over the shards with room, all or nothing
+/** @note the records are staged and checked first, then every shard is locked and grown with heap_reserve,
+ * after which the pushes cannot fail
+ * @note : caller holds pq->lock
+ * @return : number of records loaded, or a negative errno
+ */
+static int32_t multi_bulk_load(priority_queue *pq, const pb2_bulk *bulk){
+    pq_record *recs;
+    int32_t *take;
+    int32_t room = 0;
+    int32_t ret = bulk->count;
+    int32_t i, j, n, left;
+    priority_queue *h;
+
+    if(bulk->count < 0){
+        return -EINVAL;
+    }
+    if(bulk->count > pq->capacity){
+        return -EACCES;
+    }
+    if(bulk->count == 0){
+        return 0;
+    }
+    recs = kvmalloc(bulk->count * sizeof(pq_record) + pq->nr_shards * sizeof(int32_t), GFP_KERNEL);
+    if(recs == NULL){
+        return -ENOMEM;
+    }
+    take = (int32_t *)(recs + bulk->count);
+    if(copy_from_user(recs, u64_to_user_ptr(bulk->records), bulk->count * sizeof(pq_record))){
+        ret = -EFAULT;
+    }
+    for(i = 0; ret > 0 && i < bulk->count; i++){
+        if(recs[i].priority < 0){
+            ret = -EINVAL;
+        }
+    }
+    if(ret < 0){
+        kvfree(recs);
+        return ret;
+    }
+
+    multi_lock_all(pq);
+    for(i = 0; i < pq->nr_shards; i++){
+        room += pq->shards[i].pq->capacity - pq->shards[i].pq->count;
+    }
+    if(bulk->count > room){
+        ret = -EACCES;
+        goto out;
+    }
+    /* an even share for every shard, then what is left to the shards that still have room */
+    left = bulk->count;
+    for(i = 0; i < pq->nr_shards; i++){
+        h = pq->shards[i].pq;
+        take[i] = min(bulk->count / pq->nr_shards, h->capacity - h->count);
+        left -= take[i];
+    }
+    for(i = 0; left > 0; i++){
+        h = pq->shards[i].pq;
+        n = min(left, h->capacity - h->count - take[i]);
+        take[i] += n;
+        left -= n;
+    }
+    for(i = 0; i < pq->nr_shards; i++){
+        if(heap_reserve(pq->shards[i].pq, take[i]) < 0){
+            ret = -ENOMEM;
+            goto out;
+        }
+    }
+    for(i = 0, j = 0; i < pq->nr_shards; i++){
+        for(n = 0; n < take[i]; n++, j++){
+            push_element(pq->shards[i].pq, recs[j].value, recs[j].priority);
+        }
+        shard_publish(&pq->shards[i]);
+    }
+out:
+    multi_unlock_all(pq);
+    kvfree(recs);
+    return ret;
+}
+
+/** skip mode : a concurrent skiplist ordered by key (Lindén and Jonsson, "A Skiplist-Based Concurrent Priority
+ * Queue with Minimal Memory Contention", 2013), for shared queues whose pops would otherwise queue on one lock.
+ * A pop-min claims the first live node of level 0 by marking the link to it with a cmpxchg, without any lock,
+ * so concurrent pops only meet on that link; inserts and the unlinking of deleted nodes hold skip_lock.
+ * @note the key is make_key(priority, in_time) like the heap's, so the order is exact, ties included
+ * @note deleted nodes stay linked as a prefix of level 0 until a pop walks over more than PQ_SKIP_BOUND of
+ * them and unlinks them in one go; they are freed after a grace period, every walk runs under rcu_read_lock
+ * @note an insert never goes before the deleted prefix : a link can only be changed while it is unmarked
+ * @note pop-max would race with the pops at the front and is not supported (-EOPNOTSUPP), peek-max is
+ */
+#define SKIP_MARK 1UL
+
+static inline pq_skip_node* skip_ptr(unsigned long link){
+    return (pq_skip_node *)(link & ~SKIP_MARK);
+}
+
+static int32_t skip_setup(priority_queue *pq, int32_t capacity, int32_t param){
+    pq_skip_node *head = kzalloc(struct_size(head, next, PQ_SKIP_LEVELS), GFP_KERNEL);
+
+    if(head == NULL){
+        printk(KERN_ALERT DEVICE_NAME ": [PID:%d] Memory Error while allocating priority queue->skip_head!", current->pid);
+        return -ENOMEM;
+    }
+    head->height = PQ_SKIP_LEVELS;
+
+    pq->ops->release(pq);
+    pq->skip_head = head;
+    atomic_set(&pq->skip_count, 0);
+    return 0;
+}
+
+// @note : nobody walks the list any more, the nodes already unlinked are on their way out through kfree_rcu
+static void skip_release(priority_queue *pq){
+    pq_skip_node *node = pq->skip_head;
+    pq_skip_node *next;
+
+    while(node != NULL){
+        next = skip_ptr(node->next[0]);
+        kfree(node);
+        node = next;
+    }
+    pq->skip_head = NULL;
+}
+
+// skip helper : allocates a node with a random height, 1 + the number of trailing zero bits of a random word
+static pq_skip_node* skip_alloc(int32_t value, int32_t priority){
+    int32_t height = __ffs(get_random_u32() | BIT(PQ_SKIP_LEVELS - 1)) + 1;
+    pq_skip_node *node = kmalloc(struct_size(node, next, height), GFP_KERNEL);
+
+    if(node == NULL){
+        return NULL;
+    }
+    node->key = make_key(priority, 0);
+    node->value = value;
+    node->height = height;
+    node->deleted = 0;
+    return node;
+}
+
+// skip insert helper : gives the node its in_time and links it after the deleted prefix, in key order
+/** @note the upper levels are searched as if a node flagged deleted sorted before any key. Level 0 is walked
+ * over the marked links, flagging the nodes behind them, so that when the node is linked on level 0 every
+ * node before it with a larger key is flagged : on the upper levels the node then stops below the first
+ * flagged node it would precede, and every level stays in the order of level 0
+ * @note : caller holds skip_lock
+ */
+static void skip_link(priority_queue *pq, pq_skip_node *node){
+    pq_skip_node *preds[PQ_SKIP_LEVELS];
+    pq_skip_node *x = pq->skip_head;
+    pq_skip_node *next;
+    unsigned long link;
+    int32_t i;
+
+    node->key |= (uint32_t)pq->timer;
+    pq->timer += 1;
+
+    for(i = PQ_SKIP_LEVELS - 1; i > 0; i--){
+        while((next = skip_ptr(x->next[i])) != NULL && (READ_ONCE(next->deleted) || next->key < node->key)){
+            x = next;
+        }
+        preds[i] = x;
+    }
+    for(;;){
+        link = READ_ONCE(x->next[0]);
+        next = skip_ptr(link);
+        if(link & SKIP_MARK){
+            WRITE_ONCE(next->deleted, 1);
+            x = next;
+        }else if(next != NULL && next->key < node->key){
+            x = next;
+        }else{
+            node->next[0] = link;
+            /* only fails if a pop marked the link in the meantime */
+            if(cmpxchg(&x->next[0], link, (unsigned long)node) == link){
+                break;
+            }
+        }
+    }
+
+    for(i = 1; i < node->height; i++){
+        x = preds[i];
+        while((next = skip_ptr(x->next[i])) != NULL && next->key < node->key){
+            x = next;
+        }
+        /* a flagged node is either before this one on level 0 or popped after it, stop below it either way */
+        if(next != NULL && READ_ONCE(next->deleted)){
+            break;
+        }
+        node->next[i] = x->next[i];
+        WRITE_ONCE(x->next[i], (unsigned long)node);
+    }
+    node->height = i;
+}
+
+// skip cleanup function : unlinks the deleted prefix, but for its last node whose link later pops still mark
+// @note : caller holds skip_lock
+static void skip_unlink(priority_queue *pq){
+    pq_skip_node *head = pq->skip_head;
+    pq_skip_node *first, *last, *node, *next;
+    unsigned long link;
+    int32_t i;
+
+    link = READ_ONCE(head->next[0]);
+    if(!(link & SKIP_MARK)){
+        return;
+    }
+    /* flag the whole prefix, it is then a prefix of the upper levels too */
+    first = last = skip_ptr(link);
+    WRITE_ONCE(last->deleted, 1);
+    while((link = READ_ONCE(last->next[0])) & SKIP_MARK){
+        last = skip_ptr(link);
+        WRITE_ONCE(last->deleted, 1);
+    }
+    for(i = 1; i < PQ_SKIP_LEVELS; i++){
+        while((next = skip_ptr(head->next[i])) != NULL && READ_ONCE(next->deleted)){
+            WRITE_ONCE(head->next[i], next->next[i]);
+        }
+    }
+    if(first == last){
+        return;
+    }
+    /* a marked link is never changed by a pop or an insert, and the walks already past it go on to last */
+    WRITE_ONCE(head->next[0], (unsigned long)last | SKIP_MARK);
+    for(node = first; node != last; node = next){
+        next = skip_ptr(READ_ONCE(node->next[0]));
+        kfree_rcu(node, rcu);
+    }
+}
+
+// skip insert function : the push of PB2_MODE_SKIP
+// @note : takes skip_lock itself, pq->lock may or may not be held
+static int32_t skip_push(priority_queue *pq, int32_t value, int32_t priority){
+    pq_skip_node *node = skip_alloc(value, priority);
+
+    if(node == NULL){
+        return -ENOMEM;
+    }
+    mutex_lock(&pq->skip_lock);
+    if(atomic_read(&pq->skip_count) >= pq->capacity){
+        mutex_unlock(&pq->skip_lock);
+        kfree(node);
+        return -EACCES;
+    }
+    /* counted before it is linked, a pop may take it right away */
+    atomic_inc(&pq->skip_count);
+    skip_link(pq, node);
+    mutex_unlock(&pq->skip_lock);
+    return 0;
+}
+
+// skip pop function : claims the first live node, without any lock
+// @return : 0, -EAGAIN if the queue is empty, or -EOPNOTSUPP for the max
+static int32_t skip_pop(priority_queue *pq, int32_t is_max, data *out){
+    pq_skip_node *x, *node;
+    unsigned long link, old;
+    int32_t skipped = 0;
+
+    if(is_max){
+        return -EOPNOTSUPP;
+    }
+    rcu_read_lock();
+    x = pq->skip_head;
+    link = READ_ONCE(x->next[0]);
+    for(;;){
+        node = skip_ptr(link);
+        if(node == NULL){
+            rcu_read_unlock();
+            return -EAGAIN;
+        }
+        if(link & SKIP_MARK){
+            x = node;
+            link = READ_ONCE(x->next[0]);
+            skipped++;
+            continue;
+        }
+        /* a failed cmpxchg hands back what the link became : a new node to claim, or the mark of another pop */
+        old = cmpxchg(&x->next[0], link, link | SKIP_MARK);
+        if(old == link){
+            break;
+        }
+        link = old;
+    }
+    WRITE_ONCE(node->deleted, 1);
+    out->value = node->value;
+    out->priority = (int32_t)(node->key >> 32);
+    rcu_read_unlock();
+    atomic_dec(&pq->skip_count);
+
+    /* a pop that finds skip_lock taken leaves the prefix to the next one */
+    if(skipped > PQ_SKIP_BOUND && mutex_trylock(&pq->skip_lock)){
+        skip_unlink(pq);
+        mutex_unlock(&pq->skip_lock);
+    }
+    return 0;
+}
+
+// skip peek function : the first live node, or the last node found through the upper levels under skip_lock
+// @return : 0, or -EAGAIN if the queue is empty
+static int32_t skip_peek(priority_queue *pq, int32_t is_max, data *out){
+    pq_skip_node *x = pq->skip_head;
+    pq_skip_node *node, *next;
+    unsigned long link;
+    int32_t i;
+
+    if(!is_max){
+        rcu_read_lock();
+        while((link = READ_ONCE(x->next[0])) & SKIP_MARK){
+            x = skip_ptr(link);
+        }
+        node = skip_ptr(link);
+        if(node != NULL){
+            out->value = node->value;
+            out->priority = (int32_t)(node->key >> 32);
+        }
+        rcu_read_unlock();
+        return node != NULL ? 0 : -EAGAIN;
+    }
+
+    mutex_lock(&pq->skip_lock);
+    for(i = PQ_SKIP_LEVELS - 1; i >= 0; i--){
+        while((next = skip_ptr(READ_ONCE(x->next[i]))) != NULL){
+            x = next;
+        }
+    }
+    /* the deleted nodes are a prefix, if the last one is deleted they all are */
+    node = x != pq->skip_head && !READ_ONCE(x->deleted) ? x : NULL;
+    if(node != NULL){
+        out->value = node->value;
+        out->priority = (int32_t)(node->key >> 32);
+    }
+    mutex_unlock(&pq->skip_lock);
+    return node != NULL ? 0 : -EAGAIN;
+}
+
+static int32_t skip_count(priority_queue *pq){
+    return atomic_read(&pq->skip_count);
+}
+
+// skip top-k function : the first k live nodes of level 0, which are in key order
+// @note : pops running at the same time may take some of them, the result is not a snapshot of the queue
+// @return : number of elements copied to out
+static int32_t skip_top_k(priority_queue *pq, pq_record *out, int32_t k){
+    pq_skip_node *x = pq->skip_head;
+    pq_skip_node *node;
+    unsigned long link;
+    int32_t n = 0;
+
+    rcu_read_lock();
+    while((link = READ_ONCE(x->next[0])) & SKIP_MARK){
+        x = skip_ptr(link);
+    }
+    for(node = skip_ptr(link); node != NULL && n < k; node = skip_ptr(READ_ONCE(node->next[0]))){
+        out[n].value = node->value;
+        out[n].priority = (int32_t)(node->key >> 32);
+        n++;
+    }
+    rcu_read_unlock();
+    return n;
+}
+
+// skip bulk load function : inserts the records one by one under a single hold of skip_lock, all or nothing
+/** @note the records are copied and checked and their nodes allocated first, so once the room is checked
+ * under skip_lock nothing can fail
+ * @note : caller holds pq->lock
+ * @return : number of records loaded, or a negative errno
+ */
+static int32_t skip_bulk_load(priority_queue *pq, const pb2_bulk *bulk){
+    pq_record *recs;
+    pq_skip_node **nodes;
+    int32_t ret = bulk->count;
+    int32_t i, n = 0;
+
+    if(bulk->count < 0){
+        return -EINVAL;
+    }
+    if(bulk->count > pq->capacity){
+        return -EACCES;
+    }
+    if(bulk->count == 0){
+        return 0;
+    }
+    recs = kvmalloc_array(bulk->count, sizeof(pq_record) + sizeof(pq_skip_node *), GFP_KERNEL);
+    if(recs == NULL){
+        return -ENOMEM;
+    }
+    nodes = (pq_skip_node **)(recs + bulk->count);
+    if(copy_from_user(recs, u64_to_user_ptr(bulk->records), bulk->count * sizeof(pq_record))){
+        ret = -EFAULT;
+    }
+    for(i = 0; ret > 0 && i < bulk->count; i++){
+        if(recs[i].priority < 0){
+            ret = -EINVAL;
+        }
+    }
+    for(; ret > 0 && n < bulk->count; n++){
+        nodes[n] = skip_alloc(recs[n].value, recs[n].priority);
+        if(nodes[n] == NULL){
+            ret = -ENOMEM;
+            break;
+        }
+    }
+
+    if(ret > 0){
+        mutex_lock(&pq->skip_lock);
+        if(atomic_read(&pq->skip_count) > pq->capacity - bulk->count){
+            ret = -EACCES;
+        }else{
+            atomic_add(bulk->count, &pq->skip_count);
+            for(i = 0; i < bulk->count; i++){
+                skip_link(pq, nodes[i]);
+            }
+            n = 0;
+        }
+        mutex_unlock(&pq->skip_lock);
+    }
+    /* n nodes are left over on failure */
+    for(i = 0; i < n; i++){
+        kfree(nodes[i]);
+    }
+    kvfree(recs);
+    return ret;
+}
+
+// pq command function : runs a single PB2_EXEC_BATCH command against the priority_queue
+// @note : caller holds pq->lock, unless the backend is concurrent
+static void exec_cmd(priority_queue *pq, const pb2_cmd *cmd, pb2_result *res){
+    data d;
+
+    res->status = 0;
+    res->value = 0;
+    res->priority = 0;
+
+    switch(cmd->opcode){
+        case PB2_OP_INSERT:
+            res->status = min(push_element(pq, cmd->value, cmd->priority), 0);
+            return;
+
+        case PB2_OP_POP_MIN:
+        case PB2_OP_POP_MAX:
+            if(pq_is_concurrent(pq)){
+                if((res->status = pq->ops->try_pop(pq, cmd->opcode == PB2_OP_POP_MAX, &d)) < 0){
+                    res->status = res->status == -EAGAIN ? -EACCES : res->status;
+                    return;
+                }
+                break;
+            }
+            if(pq->count == 0){
+                res->status = -EACCES;
+                return;
+            }
+            pop_element(pq, cmd->opcode == PB2_OP_POP_MAX, &d);
+            break;
+
+        case PB2_OP_PEEK_MIN:
+        case PB2_OP_PEEK_MAX:
+            if(pq_is_concurrent(pq)){
+                if((res->status = pq->ops->try_peek(pq, cmd->opcode == PB2_OP_PEEK_MAX, &d)) < 0){
+                    res->status = res->status == -EAGAIN ? -EACCES : res->status;
+                    return;
+                }
+                break;
+            }
+            if(pq->count == 0){
+                res->status = -EACCES;
+                return;
+            }
+            peek_element(pq, cmd->opcode == PB2_OP_PEEK_MAX, &d);
+            break;
+
+        case PB2_OP_GET_INFO:
+            res->value = queue_count(pq);
+            res->priority = pq->capacity;
+            return;
+
+        default:
+            res->status = -EINVAL;
+            return;
+    }
+    res->value = d.value;
+    res->priority = d.priority;
+}
+
+// pq batch command function : runs the commands of a PB2_EXEC_BATCH in order, PQ_BATCH_CHUNK at a time
+// @note : a failing command only sets its own status, the following ones still run
+// @note : like a partial read() or write(), a fault in a later chunk ends the batch and the commands already
+// executed are reported, even those of a chunk whose results could not be copied back
+// @return : number of commands executed, or -EFAULT if the user buffers could not be accessed before any ran
+static int32_t exec_batch(priority_queue *pq, const pb2_batch *batch){
+    pb2_cmd cmds[PQ_BATCH_CHUNK];
+    pb2_result results[PQ_BATCH_CHUNK];
+    const pb2_cmd __user *ucmds = u64_to_user_ptr(batch->cmds);
+    pb2_result __user *uresults = u64_to_user_ptr(batch->results);
+    int32_t done = 0;
+    int32_t n, i;
+
+    if(batch->count < 0){
+        return -EINVAL;
+    }
+
+    while(done < batch->count){
+        n = min(batch->count - done, PQ_BATCH_CHUNK);
+        if(copy_from_user(cmds, ucmds + done, n * sizeof(pb2_cmd))){
+            return done > 0 ? done : -EFAULT;
+        }
+        for(i = 0; i < n; i++){
+            exec_cmd(pq, &cmds[i], &results[i]);
+        }
+        done += n;
+        if(copy_to_user(uresults + done - n, results, n * sizeof(pb2_result))){
+            return done;
+        }
+    }
+    return done;
+}
+
+// pq combining check : whether the single element ioctls of the queue go through its publication list
+// @note : shared queues only, the lock of a private queue is seldom contended and a concurrent backend has its own
+static inline int32_t pq_combines(priority_queue *pq){
+    return READ_ONCE(flat_combine) && pq->name[0] != '\0' && !pq_is_concurrent(pq);
+}
+
+// pq combiner function : runs the requests of the publication list in posting order until it stays empty
+// @note : caller holds pq->lock; at most PQ_COMBINE_PASSES passes, a steady stream of posters cannot keep one combiner forever
+// @return : whether a request may have changed the queue, the top page and the waiters need an update then
+static int32_t combine_requests(priority_queue *pq){
+    struct llist_node *list;
+    pq_combine_req *req, *next;
+    int32_t changed = 0;
+    int32_t pass;
+
+    for(pass = 0; pass < PQ_COMBINE_PASSES; pass++){
+        list = llist_del_all(&pq->combine);
+        if(list == NULL){
+            break;
+        }
+        /* llist_add pushes at the head, the oldest request is last */
+        llist_for_each_entry_safe(req, next, llist_reverse_order(list), node){
+            if(req->cmd.opcode == PQ_OP_PUSH_VALUE){
+                req->res.status = push_value(pq, req->cmd.value);
+                changed = 1;
+            }else{
+                exec_cmd(pq, &req->cmd, &req->res);
+                changed |= req->cmd.opcode == PB2_OP_INSERT || req->cmd.opcode == PB2_OP_POP_MIN || req->cmd.opcode == PB2_OP_POP_MAX;
+            }
+            smp_store_release(&req->done, 1);
+        }
+    }
+    return changed;
+}
+
+// pq combining function : runs one command on a shared queue through its publication list (flat combining)
+/** @note the poster publishes its request and whoever gets pq->lock next runs every published request in one
+ * go, so N contending posters hand the lock over once instead of N times. While the lock is held the poster
+ * polls its request, trying to become the combiner when the lock is free; after PQ_COMBINE_SPINS polls it
+ * blocks on the lock instead, the holder may be sleeping or not combining at all (e.g. PB2_TOP_K)
+ * @note the order of the queue stays strict, the requests only run in a different thread
+ * @note : the queue must be ready, as a shared queue always is
+ */
+static void combine_cmd(priority_queue *pq, const pb2_cmd *cmd, pb2_result *res){
+    pq_combine_req req;
+    int32_t spins = 0;
+    int32_t changed;
+
+    req.cmd = *cmd;
+    req.done = 0;
+    llist_add(&req.node, &pq->combine);
+
+    while(!smp_load_acquire(&req.done)){
+        if(spins < PQ_COMBINE_SPINS){
+            spins++;
+            if(mutex_is_locked(&pq->lock) || !mutex_trylock(&pq->lock)){
+                cpu_relax();
+                continue;
+            }
+        }else{
+            mutex_lock(&pq->lock);
+        }
+        /* the request is either done by the previous holder or still on the list, this pass runs it */
+        changed = combine_requests(pq);
+        if(changed){
+            update_top_page(pq);
+        }
+        mutex_unlock(&pq->lock);
+        if(changed){
+            wake_priority_queue(pq);
+        }
+    }
+    *res = req.res;
+}
+
+// ring setup function : allocates the submission / completion rings of the file, once
+// @note : the rings can only be set up once since they stay mapped until the file is closed
+static int32_t setup_ring(hashtable *entry, pb2_ring_info *info){
+    void *ring;
+
+    if(info->entries <= 0 || info->entries > PB2_RING_MAX_ENTRIES || !is_power_of_2(info->entries)){
+        return -EINVAL;
+    }
+
+    info->sq_off = sizeof(pb2_ring_hdr);
+    info->cq_off = info->sq_off + info->entries * sizeof(pb2_cmd);
+    info->size = PAGE_ALIGN(info->cq_off + info->entries * sizeof(pb2_result));
+
+    ring = vmalloc_user(info->size);
+    if(ring == NULL){
+        return -ENOMEM;
+    }
+
+    mutex_lock(&entry->ring_lock);
+    if(entry->ring != NULL){
+        mutex_unlock(&entry->ring_lock);
+        vfree(ring);
+        return -EBUSY;
+    }
+    entry->ring_sq = (pb2_cmd *)((char *)ring + info->sq_off);
+    entry->ring_cq = (pb2_result *)((char *)ring + info->cq_off);
+    entry->ring_entries = info->entries;
+    entry->ring_size = info->size;
+    entry->ring_sq_head = 0;
+    entry->ring_cq_tail = 0;
+    WRITE_ONCE(entry->ring, ring);
+    mutex_unlock(&entry->ring_lock);
+    return 0;
+}
+
+// ring drain function : runs the requests pending in the submission ring and posts their results, in order
+/** @note : caller holds entry->ring_lock and pq->lock (not for a concurrent backend); stops early once the
+ * completion ring is full
+ * @note : the mapping is writable by the user, so requests are read once and the indexes are validated
+ * @return : number of requests executed, -EINVAL if the user's indexes are out of range
+ */
+static int32_t drain_ring(hashtable *entry, priority_queue *pq){
+    pb2_ring_hdr *hdr = entry->ring;
+    uint32_t mask = entry->ring_entries - 1;
+    uint32_t sq_head = entry->ring_sq_head;
+    uint32_t cq_tail = entry->ring_cq_tail;
+    uint32_t sq_tail = smp_load_acquire(&hdr->sq_tail);
+    uint32_t cq_head = smp_load_acquire(&hdr->cq_head);
+    pb2_cmd cmd;
+    int32_t done = 0;
+
+    if(sq_tail - sq_head > entry->ring_entries || cq_tail - cq_head > entry->ring_entries){
+        return -EINVAL;
+    }
+
+    while(sq_head != sq_tail && cq_tail - cq_head < entry->ring_entries){
+        cmd.opcode = READ_ONCE(entry->ring_sq[sq_head & mask].opcode);
+        cmd.value = READ_ONCE(entry->ring_sq[sq_head & mask].value);
+        cmd.priority = READ_ONCE(entry->ring_sq[sq_head & mask].priority);
+        exec_cmd(pq, &cmd, &entry->ring_cq[cq_tail & mask]);
+        sq_head++;
+        cq_tail++;
+        done++;
+    }
+
+    /* results first, so a request is never seen consumed before its result is visible */
+    entry->ring_cq_tail = cq_tail;
+    entry->ring_sq_head = sq_head;
+    smp_store_release(&hdr->cq_tail, cq_tail);
+    smp_store_release(&hdr->sq_head, sq_head);
+    return done;
+}
+
+// ring enter function : drains the rings of the file against pq, a no-op until PB2_RING_SETUP
+// @note : caller holds entry->attach_sem for read
+static int32_t enter_ring(hashtable *entry, priority_queue *pq){
+    int32_t ret;
+
+    if(READ_ONCE(entry->ring) == NULL){
+        return 0;
+    }
+
+    mutex_lock(&entry->ring_lock);
+    if(pq_is_concurrent(pq)){
+        /* the backend locks itself */
+        ret = drain_ring(entry, pq);
+        mutex_unlock(&entry->ring_lock);
+        refresh_top_page(pq);
+    }else{
+        mutex_lock(&pq->lock);
+        if(!pq_is_ready(pq)){
+            ret = -EACCES;
+        }else{
+            ret = drain_ring(entry, pq);
+        }
+        update_top_page(pq);
+        mutex_unlock(&pq->lock);
+        mutex_unlock(&entry->ring_lock);
+    }
+
+    if(ret > 0){
+        wake_priority_queue(pq);
+    }
+    return ret;
+}
+
+// pq helper function 1 : moves the node at index up until the min-max order holds again
+static void heapify_bottom_top(priority_queue *pq, int32_t index){
+    uint64_t key = pq->keys[index];
+    pq_item item = pq->items[index];
+    int32_t parent;
+    int32_t grandparent;
+    int32_t is_max;
+
+    if(index == 0){
+        return;
+    }
+
+    /* first decide which family of levels the node belongs to by comparing with its parent */
+    parent = heap_parent(index);
+    is_max = !is_min_level(index);
+    if(key_before(pq->keys[parent], key, is_max)){
+        heap_move(pq, parent, index);
+        index = parent;
+        is_max = !is_max;
+    }
+
+    /* then bubble up along the grandparents, which lie on the same kind of level */
+    while(index > PQ_ARITY){
+        grandparent = heap_parent(heap_parent(index));
+        if(!key_before(key, pq->keys[grandparent], is_max)){
+            break;
+        }
+        heap_move(pq, grandparent, index);
+        index = grandparent;
+    }
+    heap_put(pq, index, key, item);
+}
+
+// pq helper function 2 : moves the node at parent_index down until the min-max order holds again
+static void heapify_top_bottom(priority_queue *pq, int32_t parent_index){
+    int32_t is_max = !is_min_level(parent_index);
+    uint64_t key = pq->keys[parent_index];
+    pq_item item = pq->items[parent_index];
+    uint64_t parent_key;
+    pq_item parent_item;
+    int32_t best, parent;
+
+    while((best = best_descendant(pq, parent_index, is_max)) >= 0 && key_before(pq->keys[best], key, is_max)){
+        heap_move(pq, best, parent_index);
+        if(best < heap_child(parent_index) + PQ_ARITY){
+            parent_index = best;
+            break; /* a child has no descendants on the current kind of level */
+        }
+
+        /* the element moved down two levels, it may now be out of order with its new parent : then it
+         * settles in the parent and the parent's element is carried on down instead */
+        parent = heap_parent(best);
+        if(key_before(pq->keys[parent], key, is_max)){
+            parent_key = pq->keys[parent];
+            parent_item = pq->items[parent];
+            heap_put(pq, parent, key, item);
+            key = parent_key;
+            item = parent_item;
+        }
+        parent_index = best;
+    }
+    heap_put(pq, parent_index, key, item);
+}
+
+// WRITE helper : inserts a buffer of packed pq_record's, copying it in PQ_BATCH_CHUNK sized pieces
+// @return : number of bytes consumed, a short count means the record after them was rejected
+static ssize_t write_records(priority_queue *pq, const char *inbuffer, size_t inbuffer_size) {
+    pq_record recs[PQ_BATCH_CHUNK];
+    size_t done = 0;
+    size_t chunk;
+    int32_t ret = 0;
+
+    while(done < inbuffer_size) {
+        chunk = min(inbuffer_size - done, sizeof(recs));
+        if(copy_from_user(recs, inbuffer + done, chunk)) {
+            ret = -EFAULT;
+            break;
+        }
+        ret = push_records(pq, recs, chunk / sizeof(pq_record));
+        if(ret < 0) {
+            break;
+        }
+        done += ret * sizeof(pq_record);
+        if(ret < chunk / sizeof(pq_record)) {
+            break;
+        }
+    }
+
+    pq_log(KERN_INFO DEVICE_NAME ": <dev_write> [PID:%d] inserted %ld of %ld records into priority_queue.\n", current->pid, done / sizeof(pq_record), inbuffer_size / sizeof(pq_record));
+    return done ? done : ret;
+}
+
+// WRITE : recieves values (size, number and priority) from the user procs
+// models the write() signature
+// @note : once the queue is initialized a write of N * sizeof(pq_record) bytes inserts N elements at once
+// @note : the whole write, batches included, runs under a single acquisition of the queue lock, except for a
+// batch into a concurrent backend whose records are inserted one by one (the 4-byte protocol state is not checked)
+static ssize_t dev_write(struct file* file, const char* inbuffer, size_t inbuffer_size, loff_t* pos) {
+    hashtable *proc_entry;
+    priority_queue *pq;
+    ssize_t ret;
+
+    if(!inbuffer || !inbuffer_size) 
+        return -EINVAL;
 
-    if(right_child < pq->count){
-        if( (pq->arr[smallest].priority > pq->arr[right_child].priority) 
-            ||
-            (
-                (pq->arr[right_child].priority == pq->arr[smallest].priority)
-                &&
-                (pq->arr[smallest].in_time > pq->arr[right_child].in_time)
-            )
-        ){
-            smallest = right_child;
-        }
-    }
+    proc_entry = file->private_data;
 
-    if(smallest != parent_index){
-        data temp = pq->arr[smallest];
-        pq->arr[smallest] = pq->arr[parent_index];
-        pq->arr[parent_index] = temp;
-        heapify_top_bottom(pq, smallest);
+    down_read(&proc_entry->attach_sem);
+    pq = proc_entry->pq;
+    if(pq_is_concurrent(pq) && inbuffer_size % sizeof(pq_record) == 0) {
+        /* the records go straight to the backend, which locks itself */
+        ret = write_records(pq, inbuffer, inbuffer_size);
+        refresh_top_page(pq);
+    } else {
+        mutex_lock(&pq->lock);
+        ret = write_locked(pq, inbuffer, inbuffer_size);
+        update_top_page(pq);
+        mutex_unlock(&pq->lock);
     }
+    if(ret > 0)
+        wake_priority_queue(pq);
+    up_read(&proc_entry->attach_sem);
+    return ret;
 }
 
-// WRITE : recieves values (size, number and priority) from the user procs
-// models the write() signature
-static ssize_t dev_write(struct file* file, const char* inbuffer, size_t inbuffer_size, loff_t* pos) {
-    char arr[8];
+// WRITE helper : body of dev_write, caller holds pq->lock
+static ssize_t write_locked(priority_queue *pq, const char* inbuffer, size_t inbuffer_size) {
     int32_t pq_size;
     int32_t pq_is_init = 0;
-    hashtable *proc_entry;
     char buffer[256] = {0};
     int32_t buffer_size = 0;
     int32_t num;
     int32_t ret;
 
-    if(!inbuffer || !inbuffer_size) 
-        return -EINVAL;
+    pq_is_init = pq_is_ready(pq);
+
+    if(pq_is_init && inbuffer_size % sizeof(pq_record) == 0) {
+        if(pq->input_state != 1) {
+            pq_log(KERN_ALERT DEVICE_NAME ": <dev_write> [PID:%d] batched write while a priority is still expected.", current->pid);
+            return -EINVAL;
+        }
+        return write_records(pq, inbuffer, inbuffer_size);
+    }
     
     if(copy_from_user(buffer,inbuffer,inbuffer_size<256? inbuffer_size : 256))
         return -ENOBUFS;
 
-    proc_entry = get_hashtable_entry(current->pid);
-    if(proc_entry == NULL) {
-        printk(KERN_ALERT DEVICE_NAME ": <dev_write> [PID:%d] hashtable entry for current pid is non-existent", current->pid);
-        return -EACCES;
-    }
-
-    pq_is_init = (proc_entry->pq) ? 1 : 0;
     buffer_size = inbuffer_size < 256 ? inbuffer_size : 256;
 
     if(pq_is_init) {
         if(inbuffer_size != 4) {
-            printk(KERN_ALERT DEVICE_NAME ": <dev_write> [PID:%d] %ld bytes received instead of expected 8 bytes[2*sizeof(int)].", current->pid, inbuffer_size);
+            pq_log(KERN_ALERT DEVICE_NAME ": <dev_write> [PID:%d] %ld bytes received instead of expected 4 bytes[sizeof(int)] or a multiple of 8 bytes[sizeof(pq_record)].", current->pid, inbuffer_size);
             return -EINVAL;
         }
 
-        memset(arr, 0, 4*sizeof(char));
-        memcpy(arr, inbuffer, inbuffer_size*sizeof(char));
-        memcpy(&num, arr, sizeof(num));
+        memcpy(&num, buffer, sizeof(num));
 
-        if(proc_entry->pq->input_state == 1){
-            printk(KERN_INFO DEVICE_NAME ": <dev_write> [PID:%d] received value=%d for inserting into priority_queue.\n", current->pid, num);
+        if(pq->input_state == 1){
+            pq_log(KERN_INFO DEVICE_NAME ": <dev_write> [PID:%d] received value=%d for inserting into priority_queue.\n", current->pid, num);
         }else{
-            printk(KERN_INFO DEVICE_NAME ": <dev_write> [PID:%d] received priority=%d for inserting into priority_queue.\n", current->pid, num);
+            pq_log(KERN_INFO DEVICE_NAME ": <dev_write> [PID:%d] received priority=%d for inserting into priority_queue.\n", current->pid, num);
         }
 
-        ret = push_value(proc_entry->pq, num);
+        ret = push_value(pq, num);
+        /* a full queue or a bad priority stays -EACCES for the old users, a priority below the radix floor is new */
+        if(ret == -ERANGE) {
+            pq_log(KERN_INFO DEVICE_NAME ": <dev_write> [PID:%d] priority=%d is below the last one popped.\n", current->pid, num);
+            return ret;
+        }
         if(ret < 0) {
             return -EACCES;
         }
         return sizeof(num);
     }
 
-    if(buffer_size != 1) {
+    /* the capacity is either a single byte or a full int32_t */
+    if(buffer_size == 1) {
+        pq_size = buffer[0];
+    } else if(buffer_size == sizeof(int32_t)) {
+        memcpy(&pq_size, buffer, sizeof(pq_size));
+    } else {
         return -EACCES;
     }
+    pq_log(KERN_INFO DEVICE_NAME ": <dev_write> [PID:%d] priority_queue size recieved : %d.\n", current->pid, pq_size);
 
-    pq_size = buffer[0];
-    printk(KERN_INFO DEVICE_NAME ": <dev_write> [PID:%d] priority_queue size recieved : %d.\n", current->pid, pq_size);
-
-    if(pq_size <= 0 || pq_size > 100) {
-        printk(KERN_ALERT DEVICE_NAME ": <dev_write> [PID:%d] priority_queue size must be integer in [0,100]. \n", current->pid);
+    if(!valid_capacity(pq_size)) {
+        pq_log(KERN_ALERT DEVICE_NAME ": <dev_write> [PID:%d] priority_queue size must be integer in [1,%d]. \n", current->pid, capacity_limit());
         return -EINVAL;
     }
 
-    proc_entry->pq = destroy_priority_queue(proc_entry->pq);
-    proc_entry->pq = init_priority_queue(pq_size);
+    ret = configure_priority_queue(pq, pq_size, PB2_MODE_HEAP, 0);
+    if(ret < 0) {
+        return ret;
+    }
     return buffer_size;
 }
 
 // READ : returns values to the user procs 
 // models the read() signature
+// @note : a read of k * sizeof(int32_t) bytes pops up to k elements in priority order (up to the rank error of
+// a PB2_MODE_MULTI queue, see multi_pop)
+// and hands them over with a single copy_to_user, after the queue lock is dropped
+// @note : the whole buffer is probed with clear_user before anything is popped, so a bad buffer fails with -EFAULT
+// and leaves the queue as it was; only a buffer unmapped by another thread during the read loses what was popped
+// @note : a read of an empty queue sleeps until an element is inserted, or fails with -EAGAIN under O_NONBLOCK;
+// it pins the queue rather than holding attach_sem, and starts over on the new queue if the file is attached
+// elsewhere while it sleeps
+// @note : the submission ring of the file, if set up, is drained first
 static ssize_t dev_read(struct file* file, char* inbuffer, size_t inbuffer_size, loff_t* pos) {
     int32_t ret = -1;
-    int32_t pq_is_init = 0;
     hashtable* proc_entry;
-    int32_t pq_top_elem;
+    priority_queue *pq;
+    int32_t stack_buf[PQ_BATCH_CHUNK];
+    int32_t *out = stack_buf;
+    size_t wanted;
+    int32_t popped;
+    long timeout;
 
     if(!inbuffer || !inbuffer_size) {
         return -EINVAL;
     }
 
-    proc_entry = get_hashtable_entry(current->pid);
-    if(proc_entry == NULL) {
-        printk(KERN_ALERT DEVICE_NAME ": <dev_read> [PID:%d] hashtable entry for current pid is non-existent", current->pid);
+    if(inbuffer_size % sizeof(int32_t) != 0) {
+        pq_log(KERN_INFO DEVICE_NAME ": <dev_read> [PID:%d] failed to send top of priority_queue due to invalid read by user proc. \n", current->pid);
         return -EACCES;
     }
 
-    pq_is_init = (proc_entry->pq) ? 1 : 0;
+    proc_entry = file->private_data;
+    timeout = (file->f_flags & O_NONBLOCK) ? 0 : MAX_SCHEDULE_TIMEOUT;
+retry:
+    down_read(&proc_entry->attach_sem);
+    /* requests queued in the rings of the file go in before anything is popped */
+    enter_ring(proc_entry, proc_entry->pq);
+    pq = pin_entry_queue(proc_entry);
+    up_read(&proc_entry->attach_sem);
 
-    if(!pq_is_init) {
-        printk(KERN_ALERT DEVICE_NAME ": <dev_read> [PID:%d] priority_queue not initialized.\n", current->pid);
-        return -EACCES;
+    /* stage the popped values in a buffer big enough for the request (bounded by the queue size) */
+    /* the unlocked count is only a hint, the queue may change before the lock is taken */
+    wanted = inbuffer_size / sizeof(int32_t);
+    if(wanted > PQ_BATCH_CHUNK) {
+        wanted = max_t(size_t, min_t(size_t, wanted, queue_count(pq)), PQ_BATCH_CHUNK);
+        if(wanted > PQ_BATCH_CHUNK) {
+            out = kvmalloc_array(wanted, sizeof(int32_t), GFP_KERNEL);
+            if(out == NULL) {
+                out = stack_buf;
+                ret = -ENOMEM;
+                goto out;
+            }
+        }
     }
 
-    if(sizeof(pq_top_elem) != inbuffer_size) {
-        printk(KERN_INFO DEVICE_NAME ": <dev_read> [PID:%d] failed to send top of priority_queue due to invalid read by user proc. \n", current->pid);
-        return -EACCES;
+    pq_log(KERN_INFO DEVICE_NAME ": <dev_read> [PID:%d] expecting %ld bytes.\n", current->pid, inbuffer_size);
+    /* a popped element cannot be put back in its place, so the buffer must take all of them before any is popped */
+    if(clear_user(inbuffer, wanted * sizeof(int32_t)) != 0) {
+        pq_log(KERN_INFO DEVICE_NAME ": <dev_read> [PID:%d] the buffer of the user proc is not writable.\n", current->pid);
+        ret = -EFAULT;
+        goto out;
     }
-    pq_top_elem = pop_value(proc_entry->pq);
-    
-    printk(KERN_INFO DEVICE_NAME ": <dev_read> [PID:%d] expecting %ld bytes.\n", current->pid, inbuffer_size);
-    ret = copy_to_user(inbuffer, (int32_t*)&pq_top_elem, inbuffer_size < sizeof(pq_top_elem) ? inbuffer_size : sizeof(pq_top_elem));
-    if(ret == 0 && pq_top_elem != -INF) {
-        printk(KERN_INFO DEVICE_NAME ": <dev_read> [PID:%d] sending data [%ld bytes] with value = %d to the user proc. \n ", current->pid, sizeof(pq_top_elem), pq_top_elem);
-        return sizeof(pq_top_elem);
+    if(pq_is_concurrent(pq)) {
+        /* the backend locks itself */
+        ret = concurrent_pop_values(proc_entry, pq, out, wanted, &timeout);
+        if(ret == PQ_SWITCHED) {
+            goto switched;
+        }
+        if(ret < 0) {
+            pq_log(KERN_INFO DEVICE_NAME ": <dev_read> [PID:%d] priority_queue is empty.\n", current->pid);
+            goto out;
+        }
+        popped = ret;
+        refresh_top_page(pq);
     } else {
-        printk(KERN_INFO DEVICE_NAME ": <dev_read> [PID:%d] failed to send to the user proc.\n", current->pid );
-        return -EACCES;
+        mutex_lock(&pq->lock);
+        if(!pq_is_ready(pq)) {
+            mutex_unlock(&pq->lock);
+            pq_log(KERN_ALERT DEVICE_NAME ": <dev_read> [PID:%d] priority_queue not initialized.\n", current->pid);
+            ret = -EACCES;
+            goto out;
+        }
+        ret = wait_for_element(proc_entry, pq, &timeout);
+        if(ret < 0) {
+            mutex_unlock(&pq->lock);
+            if(ret == PQ_SWITCHED) {
+                goto switched;
+            }
+            pq_log(KERN_INFO DEVICE_NAME ": <dev_read> [PID:%d] priority_queue is empty.\n", current->pid);
+            goto out;
+        }
+        popped = pop_values(pq, out, wanted);
+        update_top_page(pq);
+        mutex_unlock(&pq->lock);
+    }
+    wake_priority_queue(pq);
+
+    if(copy_to_user(inbuffer, out, popped * sizeof(int32_t)) != 0) {
+        /* the buffer was unmapped since it was probed */
+        printk(KERN_ALERT DEVICE_NAME ": <dev_read> [PID:%d] failed to send to the user proc, %d element(s) lost.\n", current->pid, popped);
+        ret = -EFAULT;
+        goto out;
+    }
+
+    pq_log(KERN_INFO DEVICE_NAME ": <dev_read> [PID:%d] sending %d value(s) [%ld bytes] to the user proc. \n ", current->pid, popped, popped * sizeof(int32_t));
+    ret = popped * sizeof(int32_t);
+out:
+    unpin_entry_queue(proc_entry, pq);
+    if(out != stack_buf) {
+        kvfree(out);
+    }
+    return ret;
+
+switched:
+    /* the file was attached to another queue while the read slept, it waits there for what is left of its timeout */
+    unpin_entry_queue(proc_entry, pq);
+    if(out != stack_buf) {
+        kvfree(out);
+        out = stack_buf;
+    }
+    goto retry;
+}
+
+// POLL : reports whether the queue of the file can be read (it holds an element) or written (it has room)
+// models the poll() signature
+// @note : an epoll registration stays on the queue the file used when it was added, re-add it after an attach or detach
+static __poll_t dev_poll(struct file* file, poll_table* wait) {
+    hashtable* proc_entry = file->private_data;
+    priority_queue *pq;
+    __poll_t mask = 0;
+    int32_t count, capacity;
+
+    down_read(&proc_entry->attach_sem);
+    pq = proc_entry->pq;
+    poll_wait(file, &pq->wait, wait);
+
+    count = queue_count(pq);
+    capacity = READ_ONCE(pq->capacity);
+    if(count > 0) {
+        mask |= EPOLLIN | EPOLLRDNORM;
     }
+    /* an unconfigured queue is writable too, the next write sets its capacity */
+    if(count < capacity || capacity == 0) {
+        mask |= EPOLLOUT | EPOLLWRNORM;
+    }
+    up_read(&proc_entry->attach_sem);
+    return mask;
+}
+
+// MMAP : maps the submission / completion rings of the file set up by PB2_RING_SETUP at PB2_RING_OFFSET,
+// or the read-only pb2_top page of the file's queue at PB2_TOP_OFFSET
+// models the mmap() signature
+// @note : like an epoll registration, the top page mapping stays on the queue the file used at mmap() time
+static int dev_mmap(struct file* file, struct vm_area_struct* vma) {
+    hashtable* proc_entry = file->private_data;
+    pb2_top *top;
+    int ret;
+
+    if(vma->vm_pgoff == (PB2_TOP_OFFSET >> PAGE_SHIFT)) {
+        if(vma->vm_end - vma->vm_start != PAGE_SIZE || (vma->vm_flags & VM_WRITE)) {
+            return -EINVAL;
+        }
+        down_read(&proc_entry->attach_sem);
+        top = map_top_page(proc_entry->pq);
+        up_read(&proc_entry->attach_sem);
+        if(top == NULL) {
+            return -ENOMEM;
+        }
+        /* no mprotect(PROT_WRITE) later on either; vm_flags is read-only from 6.3 on, older kernels write it directly */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+        vm_flags_clear(vma, VM_MAYWRITE);
+#else
+        vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+        return vm_insert_page(vma, vma->vm_start, virt_to_page(top));
+    }
+
+    if(vma->vm_pgoff != (PB2_RING_OFFSET >> PAGE_SHIFT)) {
+        return -EINVAL;
+    }
+
+    mutex_lock(&proc_entry->ring_lock);
+    if(proc_entry->ring == NULL || vma->vm_end - vma->vm_start != proc_entry->ring_size) {
+        mutex_unlock(&proc_entry->ring_lock);
+        return -EINVAL;
+    }
+    ret = remap_vmalloc_range(vma, proc_entry->ring, 0);
+    mutex_unlock(&proc_entry->ring_lock);
+
+    pq_log(KERN_INFO DEVICE_NAME ": <dev_mmap> [PID:%d] mapped %u ring entries (%d).\n", current->pid, proc_entry->ring_entries, ret);
+    return ret;
 }
 
-// OPEN : opens a new priority queue, generates a new hashtable entry
+// OPEN : opens a new priority queue, generates a new hashtable entry and binds it to the file
 // models the open() signature
+// @note : every open() gets its own queue, so a process (or each of its threads) may hold several
 // @note : before changing the hashtable spinlock is acquired
 static int dev_open(struct inode* inode, struct file* file) {
+    pq_file *pf;
     hashtable* proc_entry;
-    if(get_hashtable_entry(current->pid) != NULL) {
-        printk(KERN_ALERT DEVICE_NAME ": <dev_open> [PID:%d] process tried to open file twice.\n", current->pid);
-        return -EACCES;
-    }
 
-    proc_entry = (hashtable *)kmalloc(sizeof(hashtable), GFP_KERNEL);
-    *proc_entry = (hashtable) {current->pid, NULL, NULL};
+    /* the entry and the private queue come together out of one pq_file_cache object */
+    pf = (pq_file *)kmem_cache_alloc(pq_file_cache, GFP_KERNEL);
+    if(pf == NULL) {
+        printk(KERN_ALERT DEVICE_NAME ": <dev_open> [PID:%d] insufficient memory for hashtable entry.\n", current->pid);
+        return -ENOMEM;
+    }
+    proc_entry = &pf->entry;
+    proc_entry->key = current->pid;
+    proc_entry->own = &pf->queue;
+    init_queue_header(proc_entry->own);
+    proc_entry->pq = proc_entry->own;
+    init_rwsem(&proc_entry->attach_sem);
+    mutex_init(&proc_entry->ring_lock);
+    proc_entry->ring = NULL;
 
+    file->private_data = proc_entry;
 
     spin_lock(&pq_mutex);
-    printk(DEVICE_NAME ": <dev_open> [PID:%d] adding %d to hashtable.\n", current->pid, proc_entry->key);
+    pq_log(KERN_INFO DEVICE_NAME ": <dev_open> [PID:%d] adding %d to hashtable.\n", current->pid, proc_entry->key);
     add_process_entry(proc_entry);
 
     num_open_processes ++;
-    printk(KERN_INFO DEVICE_NAME ": <dev_open> [PID:%d] device openend by %d proc(s). \n", current->pid, num_open_processes);
+    pq_log(KERN_INFO DEVICE_NAME ": <dev_open> [PID:%d] device opened %d time(s). \n", current->pid, num_open_processes);
     print_all_processes();
     spin_unlock(&pq_mutex);
     return 0;
 }
 
 // release : empties the corresponding priority_queue, deletes the proc entry from the hashtable and
+// detaches the file from the shared queue it may be attached to
 // models the release() signature
-// @note : before changing the hashtable spinlock is acquired
+// @note : before changing the hashtable spinlock is acquired, the queues are freed once it is dropped
 static int dev_release(struct inode* inode, struct file* file) {
+    hashtable* proc_entry = file->private_data;
+
     spin_lock(&pq_mutex);
-    remove_process_entry(current->pid);
+    remove_process_entry(proc_entry);
     num_open_processes--;
-    printk(KERN_INFO DEVICE_NAME ": <dev_released> [PID:%d] closed device. device currently opened by %d proc(s). \n", current->pid, num_open_processes);
+    pq_log(KERN_INFO DEVICE_NAME ": <dev_released> [PID:%d] closed device. device currently opened %d time(s). \n", current->pid, num_open_processes);
     print_all_processes();
     spin_unlock(&pq_mutex);
+
+    free_process_entry(proc_entry);
     return 0;
 }
 
 
 /* handle ioctl commands for device */
+/** @note the shared queue commands switch the queue of the file, every other command runs on the
+ * queue the file currently uses, which cannot be switched underneath it; PB2_WAIT_POP pins it instead
+ */
 static long dev_ioctl(struct file *file, unsigned int command, unsigned long arg) 
 {
     hashtable *proc_entry;
-    int32_t pq_size;
+    long retval;
+
+    proc_entry = file->private_data; /* hashtable entry bound to this open file in dev_open */
+
+    switch (command){
+        case PB2_CREATE_SHARED:
+        case PB2_CREATE_SHARED_CONFIG:
+        case PB2_ATTACH_SHARED:
+        case PB2_DETACH_SHARED:
+            return shared_ioctl(proc_entry, command, arg);
+
+        case PB2_RING_SETUP:
+        case PB2_RING_ENTER:
+            return ring_ioctl(proc_entry, command, arg);
+
+        case PB2_WAIT_POP:
+            return wait_pop_ioctl(file, proc_entry, arg);
+    }
+
+    down_read(&proc_entry->attach_sem);
+    retval = queue_ioctl(file, proc_entry->pq, command, arg);
+    up_read(&proc_entry->attach_sem);
+    return retval;
+}
+
+/* handle the shared queue ioctl commands */
+/** @note a file is attached to at most one shared queue, attaching again (or creating) first detaches it
+ * from the previous one; the queue is freed when the last attached file detaches or is closed
+ * @note PB2_CREATE_SHARED is PB2_CREATE_SHARED_CONFIG with PB2_MODE_HEAP, the mode of a shared queue is fixed
+ */
+static long shared_ioctl(hashtable *entry, unsigned int command, unsigned long arg)
+{
+    pb2_shared_config req;
+    int32_t retval;
+
+    if(command == PB2_DETACH_SHARED){
+        retval = detach_shared_queue(entry);
+        pq_log(KERN_INFO DEVICE_NAME ": (dev_ioctl : PB2_DETACH_SHARED) (PID %d) returned %d", current->pid, retval);
+        return retval;
+    }
+
+    /* a pb2_shared is the head of a pb2_shared_config */
+    if( copy_from_user(&req, (pb2_shared_config *)arg, command == PB2_CREATE_SHARED_CONFIG ? sizeof(pb2_shared_config) : sizeof(pb2_shared)) ){
+        return -EINVAL;
+    }
+    if(command != PB2_CREATE_SHARED_CONFIG){
+        req.mode = PB2_MODE_HEAP;
+        req.param = 0;
+    }
+
+    /* the name must be NUL terminated and non empty */
+    if(req.name[0] == '\0' || strnlen(req.name, PQ_NAME_LEN) == PQ_NAME_LEN){
+        return -EINVAL;
+    }
+
+    if(command != PB2_ATTACH_SHARED){
+        if(!valid_capacity(req.capacity)){
+            pq_log(KERN_ALERT DEVICE_NAME ": (dev_ioctl : PB2_CREATE_SHARED) (PID %d) Priority Queue size value must be in the range between 1 and %d (both inclusive)", current->pid, capacity_limit());
+            return -EINVAL;
+        }
+        retval = create_shared_queue(entry, &req);
+    }else{
+        retval = attach_shared_queue(entry, req.name);
+    }
+
+    pq_log(KERN_INFO DEVICE_NAME ": (dev_ioctl : %s) (PID %d) shared queue '%s' (mode %d) returned %d", command == PB2_ATTACH_SHARED ? "PB2_ATTACH_SHARED" : "PB2_CREATE_SHARED", current->pid, req.name, req.mode, retval);
+    return retval;
+}
+
+/* handle the ring ioctl commands */
+/** @note PB2_RING_ENTER is the doorbell : it runs every request pending in the submission ring of the
+ * file and returns how many were run, their results are in the completion ring in submission order
+ */
+static long ring_ioctl(hashtable *entry, unsigned int command, unsigned long arg)
+{
+    pb2_ring_info info;
+    int32_t retval;
+
+    if(command == PB2_RING_ENTER){
+        if(READ_ONCE(entry->ring) == NULL){
+            return -EINVAL;
+        }
+        down_read(&entry->attach_sem);
+        retval = enter_ring(entry, entry->pq);
+        up_read(&entry->attach_sem);
+        pq_log(KERN_INFO DEVICE_NAME ": (dev_ioctl : PB2_RING_ENTER) (PID %d) Executed %d requests", current->pid, retval);
+        return retval;
+    }
+
+    if( copy_from_user(&info, (pb2_ring_info *)arg, sizeof(pb2_ring_info)) ){
+        return -EINVAL;
+    }
+    retval = setup_ring(entry, &info);
+    if(retval < 0){
+        return retval;
+    }
+    if( copy_to_user((pb2_ring_info *)arg, &info, sizeof(pb2_ring_info)) ){
+        return -EFAULT;
+    }
+    pq_log(KERN_INFO DEVICE_NAME ": (dev_ioctl : PB2_RING_SETUP) (PID %d) %d entries per ring, %u bytes to map", current->pid, info.entries, info.size);
+    return 0;
+}
+
+/* handle PB2_WAIT_POP */
+/** @note the wait may be long, so it pins the queue of the file rather than holding attach_sem (see pin_entry_queue);
+ * if the file is attached elsewhere meanwhile, it goes on waiting on the new queue for what is left of the timeout
+ */
+static long wait_pop_ioctl(struct file *file, hashtable *entry, unsigned long arg)
+{
+    pb2_wait_pop wait_pop;
+    priority_queue *pq;
+    long timeout;
+    long retval;
+    data d;
+
+    if( copy_from_user(&wait_pop, (pb2_wait_pop *)arg, sizeof(pb2_wait_pop)) ){
+        return -EINVAL;
+    }
+    if(wait_pop.opcode != PB2_OP_POP_MIN && wait_pop.opcode != PB2_OP_POP_MAX){
+        return -EINVAL;
+    }
+    /* O_NONBLOCK turns the wait into a plain check, like a timeout of 0 */
+    timeout = (file->f_flags & O_NONBLOCK) || wait_pop.timeout_ms == 0 ? 0 :
+              wait_pop.timeout_ms < 0 ? MAX_SCHEDULE_TIMEOUT : msecs_to_jiffies(wait_pop.timeout_ms);
+
+    do {
+        down_read(&entry->attach_sem);
+        pq = pin_entry_queue(entry);
+        up_read(&entry->attach_sem);
+
+        if(pq_is_concurrent(pq)){
+            /* the backend locks itself */
+            retval = concurrent_wait_pop(entry, pq, wait_pop.opcode == PB2_OP_POP_MAX, &timeout, &d);
+            if(retval == 0){
+                refresh_top_page(pq);
+            }
+        }else{
+            mutex_lock(&pq->lock);
+            if(!pq_is_ready(pq)){
+                mutex_unlock(&pq->lock);
+                unpin_entry_queue(entry, pq);
+                pq_log(KERN_ALERT DEVICE_NAME ": (dev_ioctl : PB2_WAIT_POP) (PID %d) Priority Queue not initialized", current->pid);
+                return -EACCES;
+            }
+            retval = wait_for_element(entry, pq, &timeout);
+            if(retval == 0){
+                pop_element(pq, wait_pop.opcode == PB2_OP_POP_MAX, &d);
+                update_top_page(pq);
+            }
+            mutex_unlock(&pq->lock);
+        }
+        if(retval == 0){
+            wake_priority_queue(pq);
+        }
+        unpin_entry_queue(entry, pq);
+    } while(retval == PQ_SWITCHED);
+
+    if(retval < 0){
+        pq_log(KERN_INFO DEVICE_NAME ": (dev_ioctl : PB2_WAIT_POP) (PID %d) no element within %d ms (%ld)", current->pid, wait_pop.timeout_ms, retval);
+        return retval;
+    }
+    wait_pop.value = d.value;
+    wait_pop.priority = d.priority;
+    if( copy_to_user((pb2_wait_pop *)arg, &wait_pop, sizeof(pb2_wait_pop)) ){
+        return -EFAULT;
+    }
+    pq_log(KERN_INFO DEVICE_NAME ": (dev_ioctl : PB2_WAIT_POP) (PID %d) Sending value %d to the user process", current->pid, d.value);
+    return 0;
+}
+
+/* handle the queue ioctl commands */
+/** @note every command takes the lock of the file's queue for the duration of the queue access only,
+ * user memory is copied in before and copied out after it (except for PB2_EXEC_BATCH which streams
+ * its buffers while holding the lock so the whole batch runs as one unit)
+ * @note on a shared queue PB2_INSERT_*, PB2_GET_*, PB2_PEEK_* and PB2_GET_INFO are posted to combine_cmd instead
+ */
+static long queue_ioctl(struct file *file, priority_queue *pq, unsigned int command, unsigned long arg)
+{
+    pb2_config config;
     int32_t value;
-    int32_t priority;
     int32_t retval;
 	obj_info pq_info;
+    pb2_batch batch;
+    pb2_top_k top_k;
+    pb2_handle_op handle_op;
+    pb2_bulk bulk;
+    pq_record record;
+    pq_record *records;
+    pb2_cmd cmd;
+    pb2_result res;
+    data d;
+
+    if(pq_is_concurrent(pq)){
+        retval = concurrent_ioctl(file, pq, command, arg);
+        if(retval != -ENOIOCTLCMD){
+            return retval;
+        }
+    }
 
     switch (command){
         case PB2_SET_CAPACITY:
-            proc_entry = get_hashtable_entry(current->pid);/* get hashtable entry corresponding to the current process PID */
-            if (proc_entry == NULL) {
-                printk(KERN_ALERT DEVICE_NAME ": (dev_ioctl : PB2_SET_CAPACITY) (PID %d) Process entry does not exist", current->pid);
-                return -EACCES;
-            }
-
-            if (copy_from_user(&pq_size, (int *)arg, sizeof(int32_t)))
+        case PB2_SET_CONFIG:
+            /* PB2_SET_CAPACITY is PB2_SET_CONFIG with PB2_MODE_HEAP */
+            if(command == PB2_SET_CAPACITY){
+                if (copy_from_user(&config.capacity, (int *)arg, sizeof(int32_t)))
+                    return -EINVAL;
+                config.mode = PB2_MODE_HEAP;
+                config.param = 0;
+            }else if (copy_from_user(&config, (pb2_config *)arg, sizeof(pb2_config))){
                 return -EINVAL;
+            }
         
-            printk(KERN_INFO DEVICE_NAME ": (dev_ioctl : PB2_SET_CAPACITY) (PID %d) Priority Queue Size received: %d", current->pid, pq_size);
+            pq_log(KERN_INFO DEVICE_NAME ": (dev_ioctl : PB2_SET_CAPACITY) (PID %d) Priority Queue Size received: %d (mode %d, param %d)", current->pid, config.capacity, config.mode, config.param);
 
             /* check pq size */
-            if (pq_size <= 0 || pq_size > 100){
-                printk(KERN_ALERT DEVICE_NAME ": (dev_ioctl : PB2_SET_CAPACITY) (PID %d) Priority Queue size value must be in the range between 1 and 100 (both inclusive)", current->pid);
+            if (!valid_capacity(config.capacity)){
+                pq_log(KERN_ALERT DEVICE_NAME ": (dev_ioctl : PB2_SET_CAPACITY) (PID %d) Priority Queue size value must be in the range between 1 and %d (both inclusive)", current->pid, capacity_limit());
                 return -EINVAL;
             }
 
-            proc_entry->pq = destroy_priority_queue(proc_entry->pq);
-            proc_entry->pq = init_priority_queue(pq_size); /* allocate space for new priority_queue */
-            break;
-
-        case PB2_INSERT_INT:
-
-            proc_entry = get_hashtable_entry(current->pid);/* get hashtable entry corresponding to the current process PID */
-            if (proc_entry == NULL) {
-                printk(KERN_ALERT DEVICE_NAME ": (dev_ioctl : PB2_INSERT_INT) (PID %d) Process entry does not exist", current->pid);
-                return -EACCES;
+            /* the capacity of a shared queue is fixed when it is created */
+            if (pq->name[0] != '\0'){
+                pq_log(KERN_ALERT DEVICE_NAME ": (dev_ioctl : PB2_SET_CAPACITY) (PID %d) capacity of shared queue '%s' cannot be changed", current->pid, pq->name);
+                return -EBUSY;
             }
 
-            if(proc_entry->pq == NULL){
-                printk(KERN_ALERT DEVICE_NAME ": (dev_ioctl : PB2_INSERT_INT) (PID %d) Priority Queue not initialized", current->pid);
-			    return -EACCES;
+            /* a concurrent backend is used without pq->lock, it cannot be swapped under a private queue */
+            if (config.mode == PB2_MODE_MULTI || config.mode == PB2_MODE_SKIP){
+                return -EINVAL;
             }
 
+            mutex_lock(&pq->lock);
+            retval = configure_priority_queue(pq, config.capacity, config.mode, config.param); /* allocate space for the emptied priority_queue */
+            update_top_page(pq);
+            mutex_unlock(&pq->lock);
+            wake_priority_queue(pq);
+            return retval;
+
+        case PB2_INSERT_INT:
+        case PB2_INSERT_PRIO:
             if( copy_from_user(&value, (int32_t *)arg, sizeof(int32_t)) ){
                 return -EINVAL;
             }
 
-            printk(KERN_INFO DEVICE_NAME ": (dev_ioctl : PB2_INSERT_INT) (PID %d) Writing %d to Priority Queue\n", current->pid, value);
-
-            retval = push_value(proc_entry->pq, value);
-            if(retval < 0){
-                return retval;
+            /* both commands feed the same value -> priority state machine as write() */
+            if(command == PB2_INSERT_INT){
+                pq_log(KERN_INFO DEVICE_NAME ": (dev_ioctl : PB2_INSERT_INT) (PID %d) Writing %d to Priority Queue\n", current->pid, value);
+            }else{
+                pq_log(KERN_INFO DEVICE_NAME ": (dev_ioctl : PB2_INSERT_PRIO) (PID %d) Writing prio = %d to Priority Queue\n", current->pid, value);
             }
-            break;
 
-        case PB2_INSERT_PRIO:
-            proc_entry = get_hashtable_entry(current->pid);/* get hashtable entry corresponding to the current process PID */
-            if (proc_entry == NULL) {
-                printk(KERN_ALERT DEVICE_NAME ": (dev_ioctl : PB2_INSERT_PRIO) (PID %d) Process entry does not exist", current->pid);
-                return -EACCES;
+            if(pq_combines(pq)){
+                cmd.opcode = PQ_OP_PUSH_VALUE;
+                cmd.value = value;
+                combine_cmd(pq, &cmd, &res);
+                return res.status;
             }
 
-            if(proc_entry->pq == NULL){
-                printk(KERN_ALERT DEVICE_NAME ": (dev_ioctl : PB2_INSERT_PRIO) (PID %d) Priority Queue not initialized", current->pid);
+            mutex_lock(&pq->lock);
+            if(!pq_is_ready(pq)){
+                mutex_unlock(&pq->lock);
+                pq_log(KERN_ALERT DEVICE_NAME ": (dev_ioctl : %s) (PID %d) Priority Queue not initialized", command == PB2_INSERT_INT ? "PB2_INSERT_INT" : "PB2_INSERT_PRIO", current->pid);
 			    return -EACCES;
             }
 
-            if( copy_from_user(&priority, (int32_t *)arg, sizeof(int32_t)) ){
-                return -EINVAL;
-            }
-
-            printk(KERN_INFO DEVICE_NAME ": (dev_ioctl : PB2_INSERT_PRIO) (PID %d) Writing prio = %d to Priority Queue\n", current->pid, value);
-
-            retval = push_value(proc_entry->pq, priority);
+            retval = push_value(pq, value);
+            update_top_page(pq);
+            mutex_unlock(&pq->lock);
             if(retval < 0){
                 return retval;
             }
+            wake_priority_queue(pq);
             break;
 
         case PB2_GET_INFO:
-            proc_entry = get_hashtable_entry(current->pid);/* get hashtable entry corresponding to the current process PID */
-            if (proc_entry == NULL) {
-                printk(KERN_ALERT DEVICE_NAME ": (dev_ioctl : PB2_GET_INFO) (PID %d) Process entry does not exist", current->pid);
-                return -EACCES;
+            if(pq_combines(pq)){
+                cmd.opcode = PB2_OP_GET_INFO;
+                combine_cmd(pq, &cmd, &res);
+                pq_info.prio_que_size = res.value;
+                pq_info.capacity = res.priority;
+                if( copy_to_user((obj_info *)arg, &pq_info, sizeof(obj_info)) ){
+                    return -EACCES;
+                }
+                break;
             }
 
-            if(proc_entry->pq == NULL){
-                printk(KERN_ALERT DEVICE_NAME ": (dev_ioctl : PB2_GET_INFO) (PID %d) Priority Queue not initialized", current->pid);
+            mutex_lock(&pq->lock);
+            if(!pq_is_ready(pq)){
+                mutex_unlock(&pq->lock);
+                pq_log(KERN_ALERT DEVICE_NAME ": (dev_ioctl : PB2_GET_INFO) (PID %d) Priority Queue not initialized", current->pid);
 			    return -EACCES;
             }
 
-            pq_info.prio_que_size = proc_entry->pq->count;
-            pq_info.capacity = proc_entry->pq->capacity;
+            pq_info.prio_que_size = pq->count;
+            pq_info.capacity = pq->capacity;
+            mutex_unlock(&pq->lock);
 
             retval = copy_to_user((obj_info *)arg, &pq_info, sizeof(obj_info));
 		    if (retval != 0){
@@ -600,63 +3982,192 @@ static long dev_ioctl(struct file *file, unsigned int command, unsigned long arg
             break;
 
         case PB2_GET_MIN:
-            proc_entry = get_hashtable_entry(current->pid);/* get hashtable entry corresponding to the current process PID */
-            if (proc_entry == NULL) {
-                printk(KERN_ALERT DEVICE_NAME ": (dev_ioctl : PB2_GET_MIN) (PID %d) Process entry does not exist", current->pid);
+        case PB2_GET_MAX:
+            if(pq_combines(pq)){
+                cmd.opcode = command == PB2_GET_MIN ? PB2_OP_POP_MIN : PB2_OP_POP_MAX;
+                combine_cmd(pq, &cmd, &res);
+                if(res.status < 0){
+                    pq_log(KERN_ALERT DEVICE_NAME ": (dev_ioctl : %s) (PID %d) Priority Queue is empty", command == PB2_GET_MIN ? "PB2_GET_MIN" : "PB2_GET_MAX", current->pid);
+                    return -EACCES;
+                }
+                value = res.value;
+            }else{
+                mutex_lock(&pq->lock);
+                if(!pq_is_ready(pq)){
+                    mutex_unlock(&pq->lock);
+                    pq_log(KERN_ALERT DEVICE_NAME ": (dev_ioctl : %s) (PID %d) Priority Queue not initialized", command == PB2_GET_MIN ? "PB2_GET_MIN" : "PB2_GET_MAX", current->pid);
+                    return -EACCES;
+                }
+
+                if(pq->count == 0){
+                    mutex_unlock(&pq->lock);
+                    pq_log(KERN_ALERT DEVICE_NAME ": (dev_ioctl : %s) (PID %d) Priority Queue is empty", command == PB2_GET_MIN ? "PB2_GET_MIN" : "PB2_GET_MAX", current->pid);
+                    return -EACCES;
+                }
+
+                value = (command == PB2_GET_MIN) ? pop_value(pq) : pop_max_value(pq);
+                update_top_page(pq);
+                mutex_unlock(&pq->lock);
+                wake_priority_queue(pq);
+            }
+
+            retval = copy_to_user((int32_t*)arg, (int32_t*)&value, sizeof(int32_t));
+            if(retval != 0){
+                pq_log(KERN_INFO DEVICE_NAME ": (dev_ioctl : %s) (PID %d) Error! Unable to send data of %ld bytes with value %d to the user process", command == PB2_GET_MIN ? "PB2_GET_MIN" : "PB2_GET_MAX", current->pid, sizeof(value), value);
                 return -EACCES;
             }
 
-            if(proc_entry->pq == NULL){
-                printk(KERN_ALERT DEVICE_NAME ": (dev_ioctl : PB2_GET_MIN) (PID %d) Priority Queue not initialized", current->pid);
-			    return -EACCES;
+            pq_log(KERN_INFO DEVICE_NAME ": (dev_ioctl : %s) (PID %d) Sending data of %ld bytes with value %d to the user process", command == PB2_GET_MIN ? "PB2_GET_MIN" : "PB2_GET_MAX", current->pid, sizeof(value), value);
+            break;
+
+        case PB2_EXEC_BATCH:
+            if( copy_from_user(&batch, (pb2_batch *)arg, sizeof(pb2_batch)) ){
+                return -EINVAL;
             }
 
-            if(proc_entry->pq->count == 0){
-                printk(KERN_ALERT DEVICE_NAME ": (dev_ioctl : PB2_GET_MIN) (PID %d) Priority Queue is empty", current->pid);
+            mutex_lock(&pq->lock);
+            if(!pq_is_ready(pq)){
+                mutex_unlock(&pq->lock);
+                pq_log(KERN_ALERT DEVICE_NAME ": (dev_ioctl : PB2_EXEC_BATCH) (PID %d) Priority Queue not initialized", current->pid);
 			    return -EACCES;
             }
 
-            value = pop_value(proc_entry->pq);
-            retval = copy_to_user((int32_t*)arg, (int32_t*)&value, sizeof(int32_t));
-            if(retval != 0){
-                printk(KERN_INFO DEVICE_NAME ": (dev_ioctl : PB2_GET_MIN) (PID %d) Error! Unable to send data of %ld bytes with value %d to the user process", current->pid, sizeof(value), value);
-                return -EACCES;
+            retval = exec_batch(pq, &batch);
+            update_top_page(pq);
+            mutex_unlock(&pq->lock);
+            wake_priority_queue(pq);
+            pq_log(KERN_INFO DEVICE_NAME ": (dev_ioctl : PB2_EXEC_BATCH) (PID %d) Executed %d of %d commands", current->pid, retval, batch.count);
+            return retval;
+
+        case PB2_PEEK_MIN:
+        case PB2_PEEK_MAX:
+            if(pq_combines(pq)){
+                cmd.opcode = command == PB2_PEEK_MIN ? PB2_OP_PEEK_MIN : PB2_OP_PEEK_MAX;
+                combine_cmd(pq, &cmd, &res);
+                if(res.status < 0){
+                    return -EACCES;
+                }
+                d.value = res.value;
+                d.priority = res.priority;
+            }else{
+                mutex_lock(&pq->lock);
+                if(!pq_is_ready(pq) || pq->count == 0){
+                    mutex_unlock(&pq->lock);
+                    pq_log(KERN_ALERT DEVICE_NAME ": (dev_ioctl : %s) (PID %d) Priority Queue not initialized or empty", command == PB2_PEEK_MIN ? "PB2_PEEK_MIN" : "PB2_PEEK_MAX", current->pid);
+                    return -EACCES;
+                }
+                peek_element(pq, command == PB2_PEEK_MAX, &d);
+                mutex_unlock(&pq->lock);
             }
 
-            printk(KERN_INFO DEVICE_NAME ": (dev_ioctl : PB2_GET_MIN) (PID %d) Sending data of %ld bytes with value %d to the user process", current->pid, sizeof(value), value);
+            record.value = d.value;
+            record.priority = d.priority;
+            if( copy_to_user((pq_record *)arg, &record, sizeof(pq_record)) ){
+                return -EFAULT;
+            }
             break;
 
-        case PB2_GET_MAX:
-            /*
-             * Left for discussion and writing
-            */
-           proc_entry = get_hashtable_entry(current->pid);/* get hashtable entry corresponding to the current process PID */
-            if (proc_entry == NULL) {
-                printk(KERN_ALERT DEVICE_NAME ": (dev_ioctl : PB2_GET_MAX) (PID %d) Process entry does not exist", current->pid);
-                return -EACCES;
+        case PB2_TOP_K:
+            if( copy_from_user(&top_k, (pb2_top_k *)arg, sizeof(pb2_top_k)) ){
+                return -EINVAL;
+            }
+            if(top_k.k < 0){
+                return -EINVAL;
             }
 
-            if(proc_entry->pq == NULL){
-                printk(KERN_ALERT DEVICE_NAME ": (dev_ioctl : PB2_GET_MAX) (PID %d) Priority Queue not initialized", current->pid);
+            mutex_lock(&pq->lock);
+            if(!pq_is_ready(pq)){
+                mutex_unlock(&pq->lock);
+                pq_log(KERN_ALERT DEVICE_NAME ": (dev_ioctl : PB2_TOP_K) (PID %d) Priority Queue not initialized", current->pid);
 			    return -EACCES;
             }
+            /* the records and the candidate indexes share one allocation */
+            top_k.k = min(top_k.k, pq->count);
+            records = kvmalloc(top_k.k * sizeof(pq_record) + top_k_candidates(pq, top_k.k) * sizeof(int32_t), GFP_KERNEL);
+            if(records == NULL){
+                mutex_unlock(&pq->lock);
+                return -ENOMEM;
+            }
+            retval = pq->ops->top_k(pq, records, (int32_t *)(records + top_k.k), top_k.k);
+            mutex_unlock(&pq->lock);
 
-            if(proc_entry->pq->count == 0){
-                printk(KERN_ALERT DEVICE_NAME ": (dev_ioctl : PB2_GET_MAX) (PID %d) Priority Queue is empty", current->pid);
+            if( retval > 0 && copy_to_user(u64_to_user_ptr(top_k.records), records, retval * sizeof(pq_record)) ){
+                retval = -EFAULT;
+            }
+            kvfree(records);
+            pq_log(KERN_INFO DEVICE_NAME ": (dev_ioctl : PB2_TOP_K) (PID %d) Sending %d elements to the user process", current->pid, retval);
+            return retval;
+
+        case PB2_INSERT_HANDLE:
+        case PB2_UPDATE_HANDLE:
+        case PB2_DELETE_HANDLE:
+            if( copy_from_user(&handle_op, (pb2_handle_op *)arg, sizeof(pb2_handle_op)) ){
+                return -EINVAL;
+            }
+
+            mutex_lock(&pq->lock);
+            if(!pq_is_ready(pq)){
+                mutex_unlock(&pq->lock);
+                pq_log(KERN_ALERT DEVICE_NAME ": (dev_ioctl : PB2_*_HANDLE) (PID %d) Priority Queue not initialized", current->pid);
 			    return -EACCES;
             }
+            /* handles name slots of the heap, the other modes have none */
+            if(pq->mode != PB2_MODE_HEAP){
+                mutex_unlock(&pq->lock);
+                return -EOPNOTSUPP;
+            }
 
-            value = pop_max_value(proc_entry->pq);
-            retval = copy_to_user((int32_t*)arg, (int32_t*)&value, sizeof(int32_t));
-            if(retval != 0){
-                printk(KERN_INFO DEVICE_NAME ": (dev_ioctl : PB2_GET_MAX) (PID %d) Error! Unable to send data of %ld bytes with value %d to the user process", current->pid, sizeof(value), value);
-                return -EACCES;
+            if(command == PB2_INSERT_HANDLE){
+                retval = push_element(pq, handle_op.value, handle_op.priority);
+                if(retval >= 0){
+                    handle_op.handle = handle_of(pq, retval);
+                }
+            }else if((retval = find_handle(pq, handle_op.handle)) >= 0){
+                if(command == PB2_DELETE_HANDLE){
+                    pop_index(pq, retval, &d);
+                    handle_op.value = d.value;
+                    handle_op.priority = d.priority;
+                }else if(handle_op.priority < 0){
+                    retval = -EINVAL;
+                }else{
+                    /* the element keeps its in_time, so it stays behind earlier elements of its new priority */
+                    pq->keys[retval] = make_key(handle_op.priority, (uint32_t)pq->keys[retval]);
+                    repair_index(pq, retval);
+                }
+            }
+            update_top_page(pq);
+            mutex_unlock(&pq->lock);
+            pq_log(KERN_INFO DEVICE_NAME ": (dev_ioctl : PB2_*_HANDLE) (PID %d) handle %llx returned %d", current->pid, handle_op.handle, min(retval, 0));
+            if(retval < 0){
+                return retval;
             }
+            wake_priority_queue(pq);
 
-            printk(KERN_INFO DEVICE_NAME ": (dev_ioctl : PB2_GET_MAX) (PID %d) Sending data of %ld bytes with value %d to the user process", current->pid, sizeof(value), value);
-            
+            if(command != PB2_UPDATE_HANDLE && copy_to_user((pb2_handle_op *)arg, &handle_op, sizeof(pb2_handle_op))){
+                return -EFAULT;
+            }
             break;
 
+        case PB2_BULK_LOAD:
+            if( copy_from_user(&bulk, (pb2_bulk *)arg, sizeof(pb2_bulk)) ){
+                return -EINVAL;
+            }
+
+            mutex_lock(&pq->lock);
+            if(!pq_is_ready(pq)){
+                mutex_unlock(&pq->lock);
+                pq_log(KERN_ALERT DEVICE_NAME ": (dev_ioctl : PB2_BULK_LOAD) (PID %d) Priority Queue not initialized", current->pid);
+			    return -EACCES;
+            }
+            retval = bulk_load(pq, &bulk);
+            update_top_page(pq);
+            mutex_unlock(&pq->lock);
+            pq_log(KERN_INFO DEVICE_NAME ": (dev_ioctl : PB2_BULK_LOAD) (PID %d) loaded %d of %d records", current->pid, retval, bulk.count);
+            if(retval > 0){
+                wake_priority_queue(pq);
+            }
+            return retval;
+
         default: 
             return -EINVAL;
 
@@ -664,18 +4175,140 @@ static long dev_ioctl(struct file *file, unsigned int command, unsigned long arg
     return 0;
 }
 
+/* handle the queue ioctl commands of a queue with a concurrent backend (PB2_MODE_MULTI, PB2_MODE_SKIP) */
+/** @note the element commands run without pq->lock, the backend takes its own locks, so the commands of a
+ * PB2_EXEC_BATCH no longer run as one unit; PB2_TOP_K and PB2_BULK_LOAD hold pq->lock around the backend
+ * @return : -ENOIOCTLCMD for the commands queue_ioctl runs as for any queue
+ */
+static long concurrent_ioctl(struct file *file, priority_queue *pq, unsigned int command, unsigned long arg)
+{
+    int32_t value;
+    int32_t retval;
+    obj_info pq_info;
+    pb2_batch batch;
+    pb2_top_k top_k;
+    pb2_bulk bulk;
+    pq_record record;
+    pq_record *records;
+    data d;
+
+    switch (command){
+        case PB2_GET_INFO:
+            pq_info.prio_que_size = pq->ops->count(pq);
+            pq_info.capacity = pq->capacity;
+            if( copy_to_user((obj_info *)arg, &pq_info, sizeof(obj_info)) ){
+                return -EACCES;
+            }
+            return 0;
+
+        case PB2_GET_MIN:
+        case PB2_GET_MAX:
+            retval = pq->ops->try_pop(pq, command == PB2_GET_MAX, &d);
+            if(retval < 0){
+                pq_log(KERN_ALERT DEVICE_NAME ": (dev_ioctl : %s) (PID %d) Priority Queue is empty", command == PB2_GET_MIN ? "PB2_GET_MIN" : "PB2_GET_MAX", current->pid);
+                return retval == -EAGAIN ? -EACCES : retval;
+            }
+            refresh_top_page(pq);
+            wake_priority_queue(pq);
+
+            value = d.value;
+            if( copy_to_user((int32_t *)arg, &value, sizeof(int32_t)) ){
+                return -EACCES;
+            }
+            pq_log(KERN_INFO DEVICE_NAME ": (dev_ioctl : %s) (PID %d) Sending data of %ld bytes with value %d to the user process", command == PB2_GET_MIN ? "PB2_GET_MIN" : "PB2_GET_MAX", current->pid, sizeof(value), value);
+            return 0;
+
+        case PB2_EXEC_BATCH:
+            if( copy_from_user(&batch, (pb2_batch *)arg, sizeof(pb2_batch)) ){
+                return -EINVAL;
+            }
+            retval = exec_batch(pq, &batch);
+            refresh_top_page(pq);
+            wake_priority_queue(pq);
+            pq_log(KERN_INFO DEVICE_NAME ": (dev_ioctl : PB2_EXEC_BATCH) (PID %d) Executed %d of %d commands", current->pid, retval, batch.count);
+            return retval;
+
+        case PB2_PEEK_MIN:
+        case PB2_PEEK_MAX:
+            retval = pq->ops->try_peek(pq, command == PB2_PEEK_MAX, &d);
+            if(retval < 0){
+                return retval == -EAGAIN ? -EACCES : retval;
+            }
+            record.value = d.value;
+            record.priority = d.priority;
+            if( copy_to_user((pq_record *)arg, &record, sizeof(pq_record)) ){
+                return -EFAULT;
+            }
+            return 0;
+
+        case PB2_TOP_K:
+            if( copy_from_user(&top_k, (pb2_top_k *)arg, sizeof(pb2_top_k)) ){
+                return -EINVAL;
+            }
+            if(top_k.k < 0){
+                return -EINVAL;
+            }
+            /* the count is a hint, collect copies at most k elements either way */
+            top_k.k = min(top_k.k, pq->ops->count(pq));
+            records = kvmalloc_array(top_k.k, sizeof(pq_record), GFP_KERNEL);
+            if(records == NULL){
+                return -ENOMEM;
+            }
+            mutex_lock(&pq->lock);
+            retval = pq->ops->collect(pq, records, top_k.k);
+            mutex_unlock(&pq->lock);
+
+            if( retval > 0 && copy_to_user(u64_to_user_ptr(top_k.records), records, retval * sizeof(pq_record)) ){
+                retval = -EFAULT;
+            }
+            kvfree(records);
+            pq_log(KERN_INFO DEVICE_NAME ": (dev_ioctl : PB2_TOP_K) (PID %d) Sending %d elements to the user process", current->pid, retval);
+            return retval;
+
+        case PB2_BULK_LOAD:
+            if( copy_from_user(&bulk, (pb2_bulk *)arg, sizeof(pb2_bulk)) ){
+                return -EINVAL;
+            }
+            mutex_lock(&pq->lock);
+            retval = pq->ops->bulk_load(pq, &bulk);
+            update_top_page(pq);
+            mutex_unlock(&pq->lock);
+            pq_log(KERN_INFO DEVICE_NAME ": (dev_ioctl : PB2_BULK_LOAD) (PID %d) loaded %d of %d records", current->pid, retval, bulk.count);
+            if(retval > 0){
+                wake_priority_queue(pq);
+            }
+            return retval;
+
+        /* handles name the slots of a heap, the concurrent backends have none */
+        case PB2_INSERT_HANDLE:
+        case PB2_UPDATE_HANDLE:
+        case PB2_DELETE_HANDLE:
+            return -EOPNOTSUPP;
+    }
+    return -ENOIOCTLCMD;
+}
+
 // init_module overload
 static int launch_module(void) {
-    struct proc_dir_entry *proc_entry = proc_create(DEVICE_NAME, PROC_FILE_MODE, NULL, &file_ops);
-    if(!proc_entry) return -ENOENT;
+    struct proc_dir_entry *proc_entry;
 
-    htable = kmalloc(sizeof(hashtable), GFP_KERNEL);
-    if(htable == NULL) {
-        printk(KERN_ALERT DEVICE_NAME ": <LKM_init_module> insufficient memory.\n");
+    /* the caches exist before the file does, so no open() can run without them */
+    pq_cache = kmem_cache_create(DEVICE_NAME "_queue", sizeof(priority_queue), 0, SLAB_HWCACHE_ALIGN, NULL);
+    pq_file_cache = kmem_cache_create(DEVICE_NAME "_file", sizeof(pq_file), 0, SLAB_HWCACHE_ALIGN, NULL);
+    if(!pq_cache || !pq_file_cache){
+        kmem_cache_destroy(pq_file_cache);
+        kmem_cache_destroy(pq_cache);
         return -ENOMEM;
     }
+    proc_entry = proc_create(DEVICE_NAME, PROC_FILE_MODE, NULL, &file_ops);
+    if(!proc_entry){
+        kmem_cache_destroy(pq_file_cache);
+        kmem_cache_destroy(pq_cache);
+        return -ENOENT;
+    }
+
+    if(debug) static_branch_enable(&pq_debug_key);
 
-    *htable = (hashtable) {-1, NULL, NULL};
     printk(KERN_INFO DEVICE_NAME ": <LKM_init_module> priority_queue LKM initialized.\n");
     spin_lock_init(&pq_mutex);
     return 0;
@@ -683,8 +4316,12 @@ static int launch_module(void) {
 
 // cleanup_module overload
 static void land_module(void) {
-    destroy_hashtable();
     remove_proc_entry(DEVICE_NAME, NULL);
+    destroy_hashtable();
+    /* the headers and pq_files freed above are still waiting for their grace period */
+    rcu_barrier();
+    kmem_cache_destroy(pq_file_cache);
+    kmem_cache_destroy(pq_cache);
     printk(KERN_INFO DEVICE_NAME ": <LKM_exit_module> priority_queue LKM terminated.\n");
 }
 
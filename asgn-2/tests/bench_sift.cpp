@@ -0,0 +1,365 @@
+/**
+ * @file : bench_sift.cpp
+ * @brief : userspace microbenchmark of the pops of lkm_module_2.c : swap based sift-down vs hole based
+ *          bottom-up (Floyd) removal, each with the scalar child selection of the module and with an AVX2 one,
+ *          the latter again paying for the kernel FPU section it would need, once per pop or once per
+ *          FPU_BATCH pops
+ * @note : build with  g++ -O2 -o bench_sift bench_sift.cpp  and run  ./bench_sift [pops]
+ *         the heap layout, key packing and handle table mirror the module; each queue size is built once,
+ *         then the same alternating min / max pop sequence is timed with every variant and the popped keys
+ *         are checked to match
+ * @note : the AVX2 selection is not in the module : it shows no steady gain over the scalar one even when the
+ *         FPU section is shared by hundreds of pops, and loses clearly when every pop pays for its own
+ */
+
+#include <bits/stdc++.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <immintrin.h>
+using namespace std;
+
+#define PQ_ARITY_BITS 2
+#define PQ_ARITY (1 << PQ_ARITY_BITS)
+#define L1_CACHE_BYTES 64
+#define FPU_BATCH 256
+
+typedef struct _pq_item {
+    int32_t value;
+    int32_t slot;
+} pq_item;
+
+typedef struct _heap {
+    void *mem;
+    uint64_t *keys;
+    pq_item *items;
+    int32_t *slots;         /* slot -> index, the part of pq->slots the sifts keep up to date */
+    int32_t count;
+} heap;
+
+/* same layout as alloc_keys() : every block of siblings starts on a multiple of PQ_ARITY keys */
+static void heap_alloc(heap *h, int32_t alloc){
+    h->mem = malloc((alloc + PQ_ARITY - 1 + L1_CACHE_BYTES / sizeof(uint64_t)) * sizeof(uint64_t));
+    h->keys = (uint64_t *)(((uintptr_t)h->mem + L1_CACHE_BYTES - 1) & ~(uintptr_t)(L1_CACHE_BYTES - 1)) + PQ_ARITY - 1;
+    h->items = (pq_item *)malloc(alloc * sizeof(pq_item));
+    h->slots = (int32_t *)malloc(alloc * sizeof(int32_t));
+    h->count = 0;
+}
+
+static void heap_free(heap *h){
+    free(h->mem);
+    free(h->items);
+    free(h->slots);
+}
+
+static inline int32_t heap_parent(int32_t index){ return (index - 1) / PQ_ARITY; }
+static inline int32_t heap_child(int32_t index){ return PQ_ARITY * index + 1; }
+static inline int32_t is_min_level(int32_t index){
+    return ((63 - __builtin_clzll((uint64_t)(PQ_ARITY - 1) * index + 1)) / PQ_ARITY_BITS & 1) == 0;
+}
+static inline int32_t key_before(uint64_t a, uint64_t b, int32_t is_max){
+    return is_max ? a > b : a < b;
+}
+static inline int32_t before(const heap *h, int32_t a, int32_t b, int32_t is_max){
+    return key_before(h->keys[a], h->keys[b], is_max);
+}
+static inline void heap_swap(heap *h, int32_t a, int32_t b){
+    swap(h->keys[a], h->keys[b]);
+    swap(h->items[a], h->items[b]);
+    h->slots[h->items[a].slot] = a;
+    h->slots[h->items[b].slot] = b;
+}
+static inline void heap_put(heap *h, int32_t index, uint64_t key, pq_item item){
+    h->keys[index] = key;
+    h->items[index] = item;
+    h->slots[item.slot] = index;
+}
+static inline void heap_move(heap *h, int32_t from, int32_t to){
+    heap_put(h, to, h->keys[from], h->items[from]);
+}
+
+// pairwise compare, select_child() of the module
+struct scalar_select {
+    static inline int32_t pick(const heap *h, int32_t first, int32_t n, int32_t is_max){
+        int32_t best = first;
+        for(int32_t i = first + 1; i < first + n; i++){
+            if(before(h, i, best, is_max)) best = i;
+        }
+        return best;
+    }
+};
+
+// vertical vpcmpgtq / vblendvpd min over the blocks of 4 keys, then a horizontal min and vmovmskpd for its position
+static int32_t select_avx2(const uint64_t *keys, int32_t n, int32_t is_max){
+    uint64_t flip = is_max ? ~0ULL : 0;
+    const uint64_t *next = keys + 4;
+    const uint64_t *end = keys + n;
+    long index = 0;
+    int mask;
+
+    asm volatile(
+        "vpbroadcastq %[flip], %%ymm3\n\t"
+        "vpxor (%[keys]), %%ymm3, %%ymm0\n\t"
+        "1: cmp %[end], %[next]\n\t"
+        "jae 2f\n\t"
+        "vpxor (%[next]), %%ymm3, %%ymm1\n\t"
+        "vpcmpgtq %%ymm1, %%ymm0, %%ymm2\n\t"
+        "vblendvpd %%ymm2, %%ymm1, %%ymm0, %%ymm0\n\t"
+        "add $32, %[next]\n\t"
+        "jmp 1b\n\t"
+        "2: vpermq $0x4e, %%ymm0, %%ymm1\n\t"
+        "vpcmpgtq %%ymm1, %%ymm0, %%ymm2\n\t"
+        "vblendvpd %%ymm2, %%ymm1, %%ymm0, %%ymm0\n\t"
+        "vpermq $0xb1, %%ymm0, %%ymm1\n\t"
+        "vpcmpgtq %%ymm1, %%ymm0, %%ymm2\n\t"
+        "vblendvpd %%ymm2, %%ymm1, %%ymm0, %%ymm0\n\t"
+        "3: vpxor (%[keys],%[index],8), %%ymm3, %%ymm1\n\t"
+        "vpcmpeqq %%ymm0, %%ymm1, %%ymm1\n\t"
+        "vmovmskpd %%ymm1, %[mask]\n\t"
+        "test %[mask], %[mask]\n\t"
+        "jnz 4f\n\t"
+        "add $4, %[index]\n\t"
+        "jmp 3b\n\t"
+        "4: vzeroupper\n\t"
+        : [next] "+r" (next), [index] "+r" (index), [mask] "=&r" (mask)
+        : [keys] "r" (keys), [end] "r" (end), [flip] "m" (flip)
+        : "cc", "memory", "xmm0", "xmm1", "xmm2", "xmm3");
+
+    return index + __builtin_ctz(mask);
+}
+
+struct avx2_select {
+    static inline int32_t pick(const heap *h, int32_t first, int32_t n, int32_t is_max){
+        if(n == PQ_ARITY || n == PQ_ARITY * PQ_ARITY) return first + select_avx2(&h->keys[first], n, is_max);
+        return scalar_select::pick(h, first, n, is_max);
+    }
+};
+
+static int32_t max_index(const heap *h){
+    int32_t best = 0;
+    for(int32_t i = 1; i <= PQ_ARITY && i < h->count; i++){
+        if(h->keys[i] > h->keys[best]) best = i;
+    }
+    return best;
+}
+
+// min-max sift-up of the module, hole based
+static void sift_up(heap *h, int32_t index){
+    uint64_t key = h->keys[index];
+    pq_item item = h->items[index];
+    int32_t parent, grandparent, is_max;
+
+    if(index == 0) return;
+    parent = heap_parent(index);
+    is_max = !is_min_level(index);
+    if(key_before(h->keys[parent], key, is_max)){
+        heap_move(h, parent, index);
+        index = parent;
+        is_max = !is_max;
+    }
+    while(index > PQ_ARITY){
+        grandparent = heap_parent(heap_parent(index));
+        if(!key_before(key, h->keys[grandparent], is_max)) break;
+        heap_move(h, grandparent, index);
+        index = grandparent;
+    }
+    heap_put(h, index, key, item);
+}
+
+/* the removal of the module before the hole based sifts : the last element replaces the popped one and
+ * is swapped down, then (as repair_index did) up */
+template <class S>
+struct swap_pop {
+    static void sift_up(heap *h, int32_t index){
+        int32_t parent, grandparent, is_max;
+
+        if(index == 0) return;
+        parent = heap_parent(index);
+        is_max = !is_min_level(index);
+        if(before(h, parent, index, is_max)){
+            heap_swap(h, parent, index);
+            index = parent;
+            is_max = !is_max;
+        }
+        while(index > PQ_ARITY){
+            grandparent = heap_parent(heap_parent(index));
+            if(!before(h, index, grandparent, is_max)) break;
+            heap_swap(h, index, grandparent);
+            index = grandparent;
+        }
+    }
+
+
+    static void sift_down(heap *h, int32_t parent_index){
+        int32_t is_max = !is_min_level(parent_index);
+        int32_t best, grand, first, n;
+
+        while(1){
+            first = heap_child(parent_index);
+            if(first >= h->count) return;
+            best = S::pick(h, first, min(PQ_ARITY, h->count - first), is_max);
+            n = min(PQ_ARITY * PQ_ARITY, h->count - heap_child(first));
+            if(n > 0){
+                grand = S::pick(h, heap_child(first), n, is_max);
+                if(before(h, grand, best, is_max)) best = grand;
+            }
+            if(!before(h, best, parent_index, is_max)) return;
+            heap_swap(h, best, parent_index);
+            if(best < first + PQ_ARITY) return;
+            if(before(h, heap_parent(best), best, is_max)) heap_swap(h, best, heap_parent(best));
+            parent_index = best;
+        }
+    }
+
+    static uint64_t pop(heap *h, int32_t index){
+        uint64_t key = h->keys[index];
+        h->count--;
+        if(index < h->count){
+            heap_move(h, h->count, index);
+            int32_t slot = h->items[index].slot;
+            if(index > 0 && before(h, index, heap_parent(index), is_min_level(index))){
+                heap_swap(h, index, heap_parent(index));
+                sift_down(h, index);
+                sift_up(h, heap_parent(index));
+            }else{
+                sift_up(h, index);
+                if(h->slots[slot] == index) sift_down(h, index);
+            }
+        }
+        return key;
+    }
+};
+
+/* pop_index() of the module : the best descendants move up into the hole down to a leaf, the last
+ * element fills it and climbs back */
+template <class S>
+struct floyd_pop {
+
+    static int32_t best_descendant(const heap *h, int32_t index, int32_t is_max){
+        int32_t first = heap_child(index);
+        int32_t best, grand, n;
+
+        if(first >= h->count) return -1;
+        best = S::pick(h, first, min(PQ_ARITY, h->count - first), is_max);
+        n = min(PQ_ARITY * PQ_ARITY, h->count - heap_child(first));
+        if(n > 0){
+            grand = S::pick(h, heap_child(first), n, is_max);
+            if(!before(h, best, grand, is_max)) best = grand;
+        }
+        return best;
+    }
+
+    static uint64_t pop(heap *h, int32_t index){
+        uint64_t key = h->keys[index];
+        int32_t is_max = !is_min_level(index);
+        int32_t hole = index, best;
+
+        while((best = best_descendant(h, hole, is_max)) >= 0){
+            heap_move(h, best, hole);
+            hole = best;
+        }
+        h->count--;
+        if(hole < h->count){
+            heap_move(h, h->count, hole);
+            sift_up(h, hole);
+        }
+        return key;
+    }
+};
+
+/* kernel_fpu_begin() XSAVEs the vector state of the task and the return to userspace XRSTORs it, the area is
+ * sized for any XCR0 short of AMX */
+static __attribute__((aligned(64))) uint8_t fpu_area[16384];
+
+__attribute__((target("xsave"))) static void fpu_section(void){
+    _xsave64(fpu_area, ~0ULL);
+    _xrstor64(fpu_area, ~0ULL);
+}
+
+// pop P, with one FPU section every B pops
+template <class P, int32_t B>
+struct fpu_pop {
+    static int32_t left;
+
+    static uint64_t pop(heap *h, int32_t index){
+        if(left-- == 0){
+            fpu_section();
+            left = B - 1;
+        }
+        return P::pop(h, index);
+    }
+};
+
+template <class P, int32_t B>
+int32_t fpu_pop<P, B>::left = 0;
+
+// builds the heap with plain insertions, the same for every variant
+static void build(heap *h, int32_t n, mt19937_64 &rng){
+    for(int32_t i = 0; i < n; i++){
+        h->keys[i] = (rng() % 1000000) << 32 | (uint32_t)i;
+        h->items[i].value = i;
+        h->items[i].slot = i;
+        h->slots[i] = i;
+        h->count = i + 1;
+        sift_up(h, i);
+    }
+}
+
+template <class P>
+static double run(const heap *src, int32_t pops, uint64_t *sum){
+    heap h;
+    heap_alloc(&h, src->count);
+    memcpy(h.keys, src->keys, src->count * sizeof(uint64_t));
+    memcpy(h.items, src->items, src->count * sizeof(pq_item));
+    memcpy(h.slots, src->slots, src->count * sizeof(int32_t));
+    h.count = src->count;
+
+    auto t0 = chrono::steady_clock::now();
+    uint64_t acc = 0;
+    for(int32_t i = 0; i < pops; i++){
+        acc = acc * 31 + P::pop(&h, (i & 1) ? max_index(&h) : 0);
+    }
+    auto t1 = chrono::steady_clock::now();
+    for(int32_t i = 0; i < h.count; i++){
+        assert(h.slots[h.items[i].slot] == i);
+    }
+    heap_free(&h);
+    *sum = acc;
+    return chrono::duration<double, nano>(t1 - t0).count() / pops;
+}
+
+int main(int argc, char **argv) {
+    int32_t max_pops = argc > 1 ? atoi(argv[1]) : 1000000;
+    bool has_avx2 = __builtin_cpu_supports("avx2");
+    mt19937_64 rng(1);
+
+    if(!has_avx2) cout << "no AVX2 on this CPU, timing the scalar selection only" << endl;
+    printf("ns per pop (alternating min / max)\n");
+    printf("%10s %8s %14s %14s %14s %14s %14s %14s\n", "elements", "pops", "swap/scalar", "floyd/scalar",
+           "swap/avx2", "floyd/avx2", "+fpu/pop", "+fpu/batch");
+    for(int32_t n = 10000; n <= 10000000; n *= 10){
+        heap h;
+        heap_alloc(&h, n);
+        build(&h, n, rng);
+
+        int32_t pops = min(n, max_pops);
+        uint64_t sum[6] = {0, 0, 0, 0, 0, 0};
+        double t[6] = {0, 0, 0, 0, 0, 0};
+        t[0] = run<swap_pop<scalar_select>>(&h, pops, &sum[0]);
+        t[1] = run<floyd_pop<scalar_select>>(&h, pops, &sum[1]);
+        if(has_avx2){
+            t[2] = run<swap_pop<avx2_select>>(&h, pops, &sum[2]);
+            t[3] = run<floyd_pop<avx2_select>>(&h, pops, &sum[3]);
+            t[4] = run<fpu_pop<floyd_pop<avx2_select>, 1>>(&h, pops, &sum[4]);
+            t[5] = run<fpu_pop<floyd_pop<avx2_select>, FPU_BATCH>>(&h, pops, &sum[5]);
+        }
+        for(int i = 1; i < (has_avx2 ? 6 : 2); i++){
+            if(sum[i] != sum[0]){
+                cout << "variants pop different keys at " << n << " elements" << endl;
+                return 1;
+            }
+        }
+        printf("%10d %8d %14.1f %14.1f %14.1f %14.1f %14.1f %14.1f\n", n, pops, t[0], t[1], t[2], t[3], t[4], t[5]);
+        heap_free(&h);
+    }
+    return 0;
+}